@@ -0,0 +1,445 @@
+#include "analysis.h"
+#include "audioFeatures.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+// what --analyzers can name, in the order of the usage text
+struct AnalyzerType
+{
+    const char *name;
+    vector<string> columns;
+    unique_ptr<Analyzer> (*make)();
+};
+
+static const vector<AnalyzerType> & analyzerTypes()
+{
+    static const vector<AnalyzerType> types{
+        {"key", {"Key"}, [] { return unique_ptr<Analyzer>(new KeyDetector); }},
+        {"tempo", {"Tempo", "Confidence"}, [] { return unique_ptr<Analyzer>(new TempoDetector); }},
+        {"loudness", {"Loudness", "ReplayGain"}, [] { return unique_ptr<Analyzer>(new LoudnessMeter); }},
+        {"levels", {"Peak", "RMS"}, [] { return unique_ptr<Analyzer>(new LevelMeter); }},
+        {"centroid", {"Centroid"}, [] { return unique_ptr<Analyzer>(new SpectralCentroid); }},
+    };
+    return types;
+}
+
+static const AnalyzerType & analyzerType(const string &name)
+{
+    for (auto &t : analyzerTypes()) {
+        if (name == t.name) {
+            return t;
+        }
+    }
+    throw invalid_argument("unknown analyzer " + name);
+}
+
+unique_ptr<Analyzer> makeAnalyzer(const string &name)
+{
+    return analyzerType(name).make();
+}
+
+vector<string> analyzerColumns(const vector<string> &names)
+{
+    vector<string> columns;
+    for (auto &name : names) {
+        auto &c = analyzerType(name).columns;
+        columns.insert(columns.end(), c.begin(), c.end());
+    }
+    return columns;
+}
+
+string analyzerList()
+{
+    string list;
+    for (auto &t : analyzerTypes()) {
+        list += list.empty() ? t.name : string(",") + t.name;
+    }
+    return list;
+}
+
+static string keyName(KeyFinder::key_t key)
+{
+     switch (key)
+     {
+     case KeyFinder::A_MAJOR:       return "A";
+     case KeyFinder::A_MINOR:       return "Am";
+     case KeyFinder::B_FLAT_MAJOR:  return "Bb";
+     case KeyFinder::B_FLAT_MINOR:  return "Bbm";
+     case KeyFinder::B_MAJOR:       return "B";
+     case KeyFinder::B_MINOR:       return "Bm";
+     case KeyFinder::C_MAJOR:       return "C";
+     case KeyFinder::C_MINOR:       return "Cm";
+     case KeyFinder::D_FLAT_MAJOR:  return "Db";
+     case KeyFinder::D_FLAT_MINOR:  return "C#m";
+     case KeyFinder::D_MAJOR:       return "D";
+     case KeyFinder::D_MINOR:       return "Dm";
+     case KeyFinder::E_FLAT_MAJOR:  return "Eb";
+     case KeyFinder::E_FLAT_MINOR:  return "Ebm";
+     case KeyFinder::E_MAJOR:       return "E";
+     case KeyFinder::E_MINOR:       return "Em";
+     case KeyFinder::F_MAJOR:       return "F";
+     case KeyFinder::F_MINOR:       return "Fm";
+     case KeyFinder::G_FLAT_MAJOR:  return "Gb";
+     case KeyFinder::G_FLAT_MINOR:  return "F#m";
+     case KeyFinder::G_MAJOR:       return "G";
+     case KeyFinder::G_MINOR:       return "Gm";
+     case KeyFinder::A_FLAT_MAJOR:  return "Ab";
+     case KeyFinder::A_FLAT_MINOR:  return "G#m";
+     default: return "";
+     }
+}
+
+// key names by pitch class (C = 0), spelled like keyName()
+static const char *const majorNames[12] = {"C", "Db", "D", "Eb", "E", "F", "Gb", "G", "Ab", "A", "Bb", "B"};
+static const char *const minorNames[12] = {"Cm", "C#m", "Dm", "Ebm", "Em", "Fm", "F#m", "Gm", "G#m", "Am", "Bbm", "Bm"};
+
+string keyFromTag(const string &tag)
+{
+    size_t b = tag.find_first_not_of(" \t"), e = tag.find_last_not_of(" \t\r\n");
+    if (b == string::npos) {
+        return "";
+    }
+    string t = tag.substr(b, e - b + 1);
+    string rest;
+    int pc;
+    if (isdigit((unsigned char)t[0])) {
+        // Camelot wheel: 1A = G#m ... 12A = C#m, nB is the relative major of nA
+        char *end = nullptr;
+        long n = strtol(t.c_str(), &end, 10);
+        if (n < 1 || n > 12 || end + 1 != t.c_str() + t.size()) {
+            return "";
+        }
+        char mode = char(toupper((unsigned char)*end));
+        if (mode != 'A' && mode != 'B') {
+            return "";
+        }
+        pc = int(8 + 7 * (n - 1)) % 12;
+        return mode == 'A' ? minorNames[pc] : majorNames[(pc + 3) % 12];
+    }
+    static const int natural[7] = {9, 11, 0, 2, 4, 5, 7};   // A..G
+    char letter = char(toupper((unsigned char)t[0]));
+    if (letter < 'A' || letter > 'G') {
+        return "";
+    }
+    pc = natural[letter - 'A'];
+    size_t i = 1;
+    if (i < t.size() && t[i] == '#') {
+        pc += 1;
+        ++i;
+    } else if (i < t.size() && t[i] == 'b') {
+        pc += 11;
+        ++i;
+    }
+    pc %= 12;
+    for (; i < t.size(); ++i) {
+        if (t[i] != ' ') rest += char(tolower((unsigned char)t[i]));
+    }
+    if (rest.empty() || rest == "maj" || rest == "major") {
+        return majorNames[pc];
+    }
+    if (rest == "m" || rest == "min" || rest == "minor") {
+        return minorNames[pc];
+    }
+    return "";
+}
+
+string tempoFromTag(const string &tag)
+{
+    char *end = nullptr;
+    double bpm = strtod(tag.c_str(), &end);
+    if (end == tag.c_str() || !(bpm >= 20 && bpm <= 400)) {
+        return "";
+    }
+    return to_string(smpl_t(bpm));
+}
+
+void AnalysisContext::resetWorkspace()
+{
+    workspace.preprocessedBuffer = KeyFinder::AudioData();
+    workspace.remainderBuffer = KeyFinder::AudioData();
+    delete workspace.chromagram;
+    workspace.chromagram = nullptr;
+    // low pass filter delay line: the new file must not start with the old one's tail
+    if (workspace.lpfBuffer) {
+        std::fill(workspace.lpfBuffer->begin(), workspace.lpfBuffer->end(), 0.0);
+    }
+}
+
+AnalysisContext & AnalysisContext::local()
+{
+    static thread_local AnalysisContext ctx;
+    return ctx;
+}
+
+void KeyDetector::begin(const AudioInfo &info)
+{
+    ctx.resetWorkspace();
+    frameRate = info.analysisRate;
+    sampleCount = 0;
+    result.clear();
+    primeBlock();
+}
+
+void KeyDetector::primeBlock()
+{
+    block = KeyFinder::AudioData();
+    block.setFrameRate(frameRate);
+    block.setChannels(1);
+    block.addToSampleCount(unsigned(blockSize));
+    block.resetIterators();
+    blockFill = 0;
+}
+
+void KeyDetector::write(const float *samples, size_t count)
+{
+    sampleCount += count;
+    while (count > 0) {
+        size_t n = min(count, blockSize - blockFill);
+        for (size_t i = 0; i < n; ++i) {
+            block.setSampleAtWriteIterator(samples[i]);
+            block.advanceWriteIterator();
+        }
+        blockFill += n;
+        samples += n;
+        count -= n;
+        if (blockFill == blockSize) {
+            flushBlock();
+        }
+    }
+}
+
+void KeyDetector::flushBlock()
+{
+    bool last = blockFill < blockSize;
+    if (last) {
+        // the end of the file: drop the part never written
+        delete block.sliceSamplesFromBack(unsigned(blockSize - blockFill));
+    }
+    // KeyFinder keeps the unfinished FFT frame in the workspace
+    ctx.keyFinder.progressiveChromagram(move(block), ctx.workspace);
+    if (last) {
+        block = KeyFinder::AudioData();
+        blockFill = 0;
+    } else {
+        primeBlock();
+    }
+}
+
+void KeyDetector::end()
+{
+    if (sampleCount == 0 && !piece) {
+        throw std::runtime_error("no samples found!");
+    }
+    if (blockFill > 0) {
+        flushBlock();
+    }
+    if (sampleCount == 0) {
+        return;
+    }
+    ctx.keyFinder.finalChromagram(ctx.workspace);
+    if (piece) {
+        // out of the thread's workspace before its next file resets it
+        chromagram.reset(ctx.workspace.chromagram);
+        ctx.workspace.chromagram = nullptr;
+        return;
+    }
+
+    // Run the analysis
+    result = keyName(ctx.keyFinder.keyOfChromagram(ctx.workspace));
+}
+
+void KeyDetector::merge(Analyzer &piece)
+{
+    auto &p = static_cast<KeyDetector &>(piece);
+    if (!p.chromagram) {
+        return;
+    }
+    if (!chromagram) {
+        chromagram = move(p.chromagram);
+    } else {
+        chromagram->append(*p.chromagram);
+        p.chromagram.reset();
+    }
+}
+
+void KeyDetector::finish()
+{
+    if (!chromagram) {
+        throw std::runtime_error("no samples found!");
+    }
+    ctx.resetWorkspace();
+    ctx.workspace.chromagram = chromagram.release();  // freed by the next reset
+    result = keyName(ctx.keyFinder.keyOfChromagram(ctx.workspace));
+}
+
+void TempoDetector::begin(const AudioInfo &info)
+{
+    if (info.analysisRate == 0) {
+        throw std::runtime_error("unknown sample rate");
+    }
+    frameSizes(info.analysisRate, winSize, hopSize);
+    // create beattracking object: aubio has no way to reset its tracking state,
+    // so this one is per file (FFTW reuses its in-process plans for the same size)
+    tempo.reset(new_aubio_tempo("specdiff", winSize, hopSize, info.analysisRate), &del_aubio_tempo);
+    if (!ctx.tempoIn || ctx.tempoIn->length != hopSize) {
+        ctx.tempoIn.reset(new_fvec(hopSize), &del_fvec);  // input buffer
+        ctx.tempoOut.reset(new_fvec(2), &del_fvec);       // output beat position
+    }
+    filled = 0;
+    estimator.reset();
+    result.clear();
+    confidence_.clear();
+}
+
+void TempoDetector::frameSizes(unsigned rate, uint_t &winSize, uint_t &hopSize)
+{
+    // same window length in seconds at every rate, rounded to a power of two for the FFT
+    double target = 512.0 * rate / 44100;
+    hopSize = 64;
+    while (hopSize * 2 <= target * M_SQRT2) {
+        hopSize *= 2;
+    }
+    winSize = hopSize * 2;
+}
+
+void TempoDetector::write(const float *samples, size_t count)
+{
+    while (count > 0) {
+        uint_t n = uint_t(min(size_t(hopSize - filled), count));
+        copy(samples, samples + n, ctx.tempoIn->data + filled);
+        filled += n;
+        samples += n;
+        count -= n;
+        if (filled < hopSize) {
+            break;
+        }
+        filled = 0;
+
+        // execute tempo
+        aubio_tempo_do(tempo.get(), ctx.tempoIn.get(), ctx.tempoOut.get());
+        if (ctx.tempoOut->data[0] != 0.0) {
+            estimator.addBeat(aubio_tempo_get_last_s(tempo.get()), aubio_tempo_get_confidence(tempo.get()));
+        }
+    }
+}
+
+void TempoDetector::end()
+{
+    if (!piece) {
+        finish();
+    }
+}
+
+void TempoDetector::merge(Analyzer &piece)
+{
+    estimator.merge(static_cast<TempoDetector &>(piece).estimator);
+}
+
+void TempoDetector::finish()
+{
+    smpl_t bpm, conf;
+    if (!estimator.estimate(bpm, conf)) {
+        throw std::runtime_error("not enough beats found");
+    }
+    result = to_string(bpm);
+    char text[8];
+    snprintf(text, sizeof text, "%.2f", double(conf));
+    confidence_ = text;
+
+    // aubio objects are freed by shared_ptr,
+    // aubio_cleanup() is called when all files are done
+}
+
+void TempoDetector::values(vector<string> &out) const
+{
+    out.push_back(result);
+    out.push_back(confidence_);
+}
+
+void TempoEstimator::reset()
+{
+    histogram.fill(0);
+    intervalCount = 0;
+    lastBeat = -1;
+    votes = 0;
+}
+
+void TempoEstimator::addBeat(smpl_t seconds, smpl_t confidence)
+{
+    smpl_t interval = seconds - lastBeat;
+    bool first = lastBeat < 0;
+    lastBeat = seconds;
+    // faster than 300 or slower than 30 BPM: a spurious or a missed beat
+    if (first || interval < smpl_t(0.2) || interval > smpl_t(2)) {
+        return;
+    }
+    intervals[intervalCount++ % ringSize] = interval;
+
+    std::array<smpl_t, ringSize> sorted;
+    size_t n = min(intervalCount, ringSize);
+    copy(intervals.begin(), intervals.begin() + n, sorted.begin());
+    nth_element(sorted.begin(), sorted.begin() + n / 2, sorted.begin() + n);
+    smpl_t bpm = 60 / sorted[n / 2];
+    if (bpm < minBpm || bpm > maxBpm) {
+        return;
+    }
+    // split between the two nearest bins; a beat aubio is unsure of still counts a little
+    smpl_t weight = smpl_t(0.1) + max(confidence, smpl_t(0));
+    smpl_t x = (bpm - minBpm) / binWidth;
+    size_t i = min(size_t(x), bins - 2);
+    smpl_t f = x - i;
+    histogram[i] += weight * (1 - f);
+    histogram[i + 1] += weight * f;
+    ++votes;
+}
+
+void TempoEstimator::merge(const TempoEstimator &other)
+{
+    for (size_t i = 0; i < bins; ++i) {
+        histogram[i] += other.histogram[i];
+    }
+    votes += other.votes;
+}
+
+bool TempoEstimator::estimate(smpl_t &bpm, smpl_t &confidence) const
+{
+    smpl_t total = accumulate(histogram.begin(), histogram.end(), smpl_t(0));
+    if (votes < 4 || total <= 0) {
+        return false;
+    }
+    // peak of the histogram smoothed over +-1 BPM, refined by the mean within it
+    const size_t span = 2;
+    size_t peak = 0;
+    smpl_t best = -1;
+    for (size_t i = 0; i < bins; ++i) {
+        smpl_t sum = 0;
+        for (size_t k = i >= span ? i - span : 0; k <= min(i + span, bins - 1); ++k) {
+            sum += histogram[k];
+        }
+        if (sum > best) {
+            best = sum;
+            peak = i;
+        }
+    }
+    smpl_t weighted = 0;
+    for (size_t k = peak >= span ? peak - span : 0; k <= min(peak + span, bins - 1); ++k) {
+        weighted += histogram[k] * k;
+    }
+    bpm = minBpm + weighted / best * binWidth;
+
+    smpl_t near = 0;
+    for (size_t i = 0; i < bins; ++i) {
+        if (fabs(minBpm + i * binWidth - bpm) <= bpm * smpl_t(0.02)) {
+            near += histogram[i];
+        }
+    }
+    confidence = min(near / total, smpl_t(1));
+    return true;
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include "decodeAudio.h"
+#include "keyfinder/keyfinder.h"
+#include "aubio/aubio.h"
+
+struct CentroidFft;
+
+/**
+  Analysis resources each worker thread keeps from file to file:
+  KeyFinder caches its FFT plans, filters and tone profiles per frame rate,
+  so they are only built again when a file with a new sample rate comes in
+ *
+ */
+struct AnalysisContext
+{
+    KeyFinder::KeyFinder keyFinder;
+    // reused for every file: keeps KeyFinder's FFT adapter and filter buffer
+    KeyFinder::Workspace workspace;
+    // aubio input/output vectors, allocated by the first TempoDetector
+    std::shared_ptr<fvec_t> tempoIn;
+    std::shared_ptr<fvec_t> tempoOut;
+    // SpectralCentroid's FFT plan and buffers, planned again for a new frame size
+    std::shared_ptr<CentroidFft> centroidFft;
+
+    // drop the previous file's audio and chromagram from the workspace
+    void resetWorkspace();
+    // context of the calling thread
+    static AnalysisContext & local();
+};
+
+/**
+  Key tag in the spelling of the Key column ("Am", "C#m", "Bb"...);
+  accepts names like "A minor", "Amin", "F#", "Gb major" and Camelot codes ("8A").
+  Empty if the tag is not understood
+ *
+ */
+std::string keyFromTag(const std::string &tag);
+
+// BPM tag in the format of the Tempo column, empty if it is not a plausible tempo
+std::string tempoFromTag(const std::string &tag);
+
+/**
+  One feature of the decoded audio (key, tempo, loudness...) with its own
+  CSV columns. All analyzers of a run are sinks of the same decode, so
+  a file is decoded once however many of them are enabled.
+  The pieces of a split file are analyzed separately, merged in track
+  order and finished into one result
+ *
+ */
+class Analyzer : public AudioSink
+{
+public:
+    // end() keeps what merge() needs instead of computing the result
+    virtual void setPiece() = 0;
+    // add a finished piece of the same track, from an analyzer of the same type
+    virtual void merge(Analyzer &piece) = 0;
+    // result of the merged pieces, throws std::runtime_error like end()
+    virtual void finish() = 0;
+    // append the values of the columns (analyzerColumns()) after end() or finish()
+    virtual void values(std::vector<std::string> &out) const = 0;
+};
+
+/**
+  Analyzer for a name of --analyzers ("key", "tempo", "loudness", "levels",
+  "centroid"), working with the calling thread's context.
+  throws std::invalid_argument for an unknown name
+ *
+ */
+std::unique_ptr<Analyzer> makeAnalyzer(const std::string &name);
+// CSV columns of the named analyzers, in order; throws std::invalid_argument like makeAnalyzer()
+std::vector<std::string> analyzerColumns(const std::vector<std::string> &names);
+// names accepted by makeAnalyzer(), for the usage text
+std::string analyzerList();
+
+/**
+  Musical key of a decoded stream, estimated with KeyFinder's
+  progressive chromagram: samples are handed over in blocks,
+  so memory does not depend on track length
+ *
+ */
+class KeyDetector : public Analyzer
+{
+    static const size_t blockSize = 65536;
+    AnalysisContext &ctx;
+    // samples go straight from write() into the block KeyFinder takes next,
+    // sized up front so the write iterator stays valid
+    KeyFinder::AudioData block;
+    size_t blockFill{0};
+    unsigned frameRate{0};
+    size_t sampleCount{0};
+    std::string result;
+    // piece of a split file: end() keeps the chromagram here instead of estimating the key
+    bool piece{false};
+    std::unique_ptr<KeyFinder::Chromagram> chromagram;
+public:
+    explicit KeyDetector(AnalysisContext &ctx = AnalysisContext::local()) : ctx(ctx) {}
+    void begin(const AudioInfo &info) override;
+    void write(const float *samples, size_t count) override;
+    void end() override;
+    const std::string & key() const { return result; }
+
+    void setPiece() override { piece = true; }
+    // append the chromagram of a finished piece; pieces in track order
+    void merge(Analyzer &piece) override;
+    // key of the merged pieces
+    void finish() override;
+    // Key
+    void values(std::vector<std::string> &out) const override { out.push_back(result); }
+private:
+    // an empty block of blockSize samples to write into
+    void primeBlock();
+    void flushBlock();
+};
+
+/**
+  Tempo of a beat stream in one pass and fixed memory: each beat's interval
+  to the previous one goes into a ring of the last intervals, their median
+  votes for a tempo in a histogram (weighted by aubio's confidence) and
+  the tempo is the histogram's peak. Outliers and the odd missed or extra
+  beat move the median, not the estimate.
+ *
+ */
+class TempoEstimator
+{
+public:
+    static constexpr smpl_t minBpm = 40;
+    static constexpr smpl_t maxBpm = 250;
+    static constexpr smpl_t binWidth = 0.5;
+    static constexpr size_t bins = size_t((maxBpm - minBpm) / binWidth) + 1;
+    static constexpr size_t ringSize = 8;
+
+    void reset();
+    // beat at seconds from the start
+    void addBeat(smpl_t seconds, smpl_t confidence);
+    // add the votes of another part of the same track
+    void merge(const TempoEstimator &other);
+    // false if there were too few beats; confidence is the share of votes near the tempo
+    bool estimate(smpl_t &bpm, smpl_t &confidence) const;
+private:
+    std::array<smpl_t, bins> histogram{};
+    std::array<smpl_t, ringSize> intervals{};
+    size_t intervalCount{0};    // intervals seen, the ring holds the last ringSize
+    smpl_t lastBeat{-1};
+    size_t votes{0};
+};
+
+/**
+  Tempo (BPM) of a decoded stream, beats are tracked by aubio
+  hop by hop while the file is decoded
+ *
+ */
+class TempoDetector : public Analyzer
+{
+    AnalysisContext &ctx;
+    // scaled with the sample rate: 1024/512 at 44.1 kHz
+    uint_t winSize{1024};
+    uint_t hopSize{512};
+    std::shared_ptr<aubio_tempo_t> tempo;
+    uint_t filled{0};
+    TempoEstimator estimator;
+    std::string result;
+    std::string confidence_;
+    // piece of a split file: end() keeps the votes for merge() instead of estimating
+    bool piece{false};
+public:
+    explicit TempoDetector(AnalysisContext &ctx = AnalysisContext::local()) : ctx(ctx) {}
+    void begin(const AudioInfo &info) override;
+    void write(const float *samples, size_t count) override;
+    void end() override;
+    const std::string & bpm() const { return result; }
+    // 0..1, how much of the track agrees with bpm()
+    const std::string & confidence() const { return confidence_; }
+    // aubio frame sizes used at a sample rate
+    static void frameSizes(unsigned rate, uint_t &winSize, uint_t &hopSize);
+
+    void setPiece() override { piece = true; }
+    // add the votes of a finished piece
+    void merge(Analyzer &piece) override;
+    // tempo of the merged pieces
+    void finish() override;
+    // Tempo, Confidence
+    void values(std::vector<std::string> &out) const override;
+};
+
+// adds the time spent in every call into the wrapped sink to total
+class TimedSink : public AudioSink
+{
+    AudioSink &inner;
+    std::chrono::nanoseconds &total;
+    using Clock = std::chrono::steady_clock;
+public:
+    TimedSink(AudioSink &inner, std::chrono::nanoseconds &total) : inner(inner), total(total) {}
+    void begin(const AudioInfo &info) override { auto t = Clock::now(); inner.begin(info); total += Clock::now() - t; }
+    void write(const float *s, size_t n) override { auto t = Clock::now(); inner.write(s, n); total += Clock::now() - t; }
+    void end() override { auto t = Clock::now(); inner.end(); total += Clock::now() - t; }
+    bool wantsFrames() const override { return inner.wantsFrames(); }
+    void writeFrames(const float *s, size_t n, unsigned channels, unsigned rate) override {
+        auto t = Clock::now();
+        inner.writeFrames(s, n, channels, rate);
+        total += Clock::now() - t;
+    }
+};
+
+// passes one decoded stream to several sinks
+class SinkFanout : public AudioSink
+{
+    std::vector<AudioSink *> sinks;
+public:
+    SinkFanout(std::initializer_list<AudioSink *> l) : sinks(l) {}
+    explicit SinkFanout(std::vector<AudioSink *> v) : sinks(std::move(v)) {}
+    void begin(const AudioInfo &info) override { for (auto s : sinks) s->begin(info); }
+    void write(const float *samples, size_t count) override { for (auto s : sinks) s->write(samples, count); }
+    void end() override { for (auto s : sinks) s->end(); }
+    bool wantsFrames() const override {
+        return std::any_of(sinks.begin(), sinks.end(), [](AudioSink *s) { return s->wantsFrames(); });
+    }
+    void writeFrames(const float *samples, size_t frames, unsigned channels, unsigned rate) override {
+        for (auto s : sinks) {
+            if (s->wantsFrames()) s->writeFrames(samples, frames, channels, rate);
+        }
+    }
+};
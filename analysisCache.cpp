@@ -0,0 +1,312 @@
+#include "analysisCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const char *cacheHeader = "#AudioAnalyzer cache v4";
+// entries without their decode settings: read, then rewritten as v4 (and never matched)
+static const char *cacheHeaderV3 = "#AudioAnalyzer cache v3";
+// entries with the key, tempo and confidence columns only, no settings either
+static const char *cacheHeaderV2 = "#AudioAnalyzer cache v2";
+
+static string escape(const string &s)
+{
+    string r;
+    r.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+        case '\\': r += "\\\\"; break;
+        case '\t': r += "\\t"; break;
+        case '\n': r += "\\n"; break;
+        default: r += c;
+        }
+    }
+    return r;
+}
+
+static string unescape(const string &s)
+{
+    string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            char c = s[++i];
+            r += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        } else {
+            r += s[i];
+        }
+    }
+    return r;
+}
+
+// path, size, mtime, hash, duration, frequency, settings, then column=value for each column
+template <class Entry>
+static void writeEntry(ostream &os, const Entry &e)
+{
+    char hash[17];
+    snprintf(hash, sizeof hash, "%016llx", (unsigned long long)e.key.hash);
+    os << escape(e.key.path) << '\t' << e.key.size << '\t' << e.key.mtime << '\t' << hash << '\t'
+       << e.duration << '\t' << e.frequency << '\t' << escape(e.settings);
+    for (auto &v : e.values) {
+        os << '\t' << v.first << '=' << escape(v.second);
+    }
+    os << '\n';
+}
+
+template <class Entry>
+static bool readEntry(const string &line, int version, Entry &e)
+{
+    vector<string> fields;
+    size_t start = 0;
+    for (;;) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab - start));
+        if (tab == string::npos) break;
+        start = tab + 1;
+    }
+    bool v2 = version == 2;
+    size_t first = version >= 4 ? 7 : 6;    // of the values
+    if (fields.size() < first || (v2 && fields.size() != 9)) {
+        return false;
+    }
+    try {
+        e.key.path = unescape(fields[0]);
+        e.key.size = stoull(fields[1]);
+        e.key.mtime = stoll(fields[2]);
+        e.key.hash = stoull(fields[3], nullptr, 16);
+        e.duration = stoll(fields[4]);
+        e.frequency = unsigned(stoul(fields[5]));
+        e.settings = version >= 4 ? unescape(fields[6]) : "";
+    } catch (exception &) {
+        return false;
+    }
+    if (v2) {
+        e.values = {{"Key", unescape(fields[6])}, {"Tempo", unescape(fields[7])}, {"Confidence", fields[8]}};
+        return true;
+    }
+    for (size_t i = first; i < fields.size(); ++i) {
+        size_t eq = fields[i].find('=');
+        if (eq == string::npos) {
+            return false;
+        }
+        e.values.emplace_back(fields[i].substr(0, eq), unescape(fields[i].substr(eq + 1)));
+    }
+    return true;
+}
+
+AnalysisCache::AnalysisCache(const string &path, const vector<string> &columns, const string &settings)
+    : path(path), columns(columns), settings(settings)
+{
+    ifstream in(path);
+    string line;
+    int version = 0;
+    if (in && getline(in, line)) {
+        version = line == cacheHeader ? 4 : line == cacheHeaderV3 ? 3 : line == cacheHeaderV2 ? 2 : 0;
+    }
+    bool valid = version > 0;
+    if (valid) {
+        // later lines override earlier ones; a torn last line is just skipped
+        while (getline(in, line)) {
+            Entry e;
+            if (readEntry(line, version, e)) {
+                add(move(e));
+            }
+        }
+    }
+    if (valid && version < 4) {
+        // written with every entry in the new format before anything is appended
+        vector<string> paths;
+        for (auto &e : byPath) {
+            paths.push_back(e.first);
+        }
+        rewrite(paths);
+    } else if (valid) {
+        log.open(path, ios::app);
+    } else {
+        log.open(path, ios::trunc);
+        log << cacheHeader << '\n';
+    }
+    if (!log) {
+        throw runtime_error("can't open cache file " + path);
+    }
+}
+
+void AnalysisCache::add(Entry entry)
+{
+    auto it = byPath.find(entry.key.path);
+    if (it != byPath.end() && it->second.key.hash) {
+        auto range = byHash.equal_range(it->second.key.hash);
+        for (auto h = range.first; h != range.second; ++h) {
+            if (h->second == entry.key.path) {
+                byHash.erase(h);
+                break;
+            }
+        }
+    }
+    if (entry.key.hash) {
+        byHash.emplace(entry.key.hash, entry.key.path);
+    }
+    string p = entry.key.path;
+    byPath[p] = move(entry);
+}
+
+bool AnalysisCache::toResult(const Entry &entry, AnalysisResult &result) const
+{
+    // made with another analysis rate, channel mode or segments
+    if (entry.settings != settings) {
+        return false;
+    }
+    result.duration = entry.duration;
+    result.frequency = entry.frequency;
+    result.values.clear();
+    for (auto &c : columns) {
+        auto v = find_if(entry.values.begin(), entry.values.end(), [&](auto &p) { return p.first == c; });
+        if (v == entry.values.end()) {
+            return false;
+        }
+        result.values.push_back(v->second);
+    }
+    return true;
+}
+
+bool AnalysisCache::lookup(const CacheKey &key, AnalysisResult &result)
+{
+    lock_guard<mutex> l(m);
+    auto it = byPath.find(key.path);
+    if (it != byPath.end()) {
+        const CacheKey &k = it->second.key;
+        if (k.size == key.size && k.mtime == key.mtime && (!key.hash || !k.hash || k.hash == key.hash)) {
+            if (!toResult(it->second, result)) {
+                return false;
+            }
+            used.insert(key.path);
+            ++hits;
+            return true;
+        }
+    }
+    if (!key.hash) {
+        return false;
+    }
+    auto range = byHash.equal_range(key.hash);
+    for (auto h = range.first; h != range.second; ++h) {
+        auto &entry = byPath.at(h->second);
+        if (entry.key.size == key.size && toResult(entry, result)) {
+            // remember the file under its current path and mtime
+            Entry found = entry;
+            found.key = key;
+            writeEntry(log, found);
+            log.flush();
+            add(move(found));
+            used.insert(key.path);
+            ++hits;
+            return true;
+        }
+    }
+    return false;
+}
+
+void AnalysisCache::store(const CacheKey &key, const AnalysisResult &result)
+{
+    lock_guard<mutex> l(m);
+    Entry e{key, result.duration, result.frequency, settings, {}};
+    for (size_t i = 0; i < columns.size() && i < result.values.size(); ++i) {
+        e.values.emplace_back(columns[i], result.values[i]);
+    }
+    auto it = byPath.find(key.path);
+    if (it != byPath.end() && it->second.key.size == key.size && it->second.key.mtime == key.mtime &&
+        it->second.settings == settings) {
+        // same file and settings: keep what other analyzers found
+        for (auto &v : it->second.values) {
+            if (find(columns.begin(), columns.end(), v.first) == columns.end()) {
+                e.values.push_back(v);
+            }
+        }
+    }
+    writeEntry(log, e);
+    add(move(e));
+    used.insert(key.path);
+}
+
+void AnalysisCache::flush()
+{
+    lock_guard<mutex> l(m);
+    log.flush();
+}
+
+void AnalysisCache::compact()
+{
+    lock_guard<mutex> l(m);
+    rewrite(vector<string>(used.begin(), used.end()));
+}
+
+void AnalysisCache::rewrite(const vector<string> &paths)
+{
+    string tmp = path + ".tmp";
+    {
+        ofstream out(tmp, ios::trunc);
+        out << cacheHeader << '\n';
+        for (auto &p : paths) {
+            writeEntry(out, byPath.at(p));
+        }
+        if (!out.flush()) {
+            throw runtime_error("can't write cache file " + tmp);
+        }
+    }
+    log.close();
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        throw runtime_error("can't replace cache file " + path + ": " + strerror(errno));
+    }
+    log.open(path, ios::app);
+}
+
+CacheKey cacheKeyOf(const string &path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        throw runtime_error("can't stat " + path + ": " + strerror(errno));
+    }
+    CacheKey key;
+    key.path = path;
+    key.size = uint64_t(st.st_size);
+    key.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return key;
+}
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t contentHash(const InputBuffer &buf)
+{
+    // xxHash64-style: four independent lanes keep the multiplier pipelines busy
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL, p3 = 0x165667B19E3779F9ULL;
+    const uint8_t *p = buf.data(), *end = p + buf.size();
+    uint64_t lane[4] = {p1 + p2, p2, 0, 0 - p1};
+    auto round = [&](uint64_t acc, uint64_t in) { return rotl(acc + in * p2, 31) * p1; };
+    while (end - p >= 32) {
+        for (int i = 0; i < 4; ++i) {
+            uint64_t w;
+            memcpy(&w, p + 8 * i, 8);
+            lane[i] = round(lane[i], w);
+        }
+        p += 32;
+    }
+    uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+    h += buf.size();
+    while (p < end) {
+        h = rotl(h ^ (*p++ * p3), 11) * p1;
+    }
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h ? h : 1;  // 0 means "no hash"
+}
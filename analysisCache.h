@@ -0,0 +1,86 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "result.h"
+#include "inputBuffer.h"
+
+// identity of one input file as seen by the cache
+struct CacheKey
+{
+    std::string path;
+    uint64_t size{0};
+    int64_t mtime{0};   // nanoseconds since epoch
+    uint64_t hash{0};   // content hash, 0 = not computed
+};
+
+/**
+  On-disk store of analysis results from previous runs.
+  An entry matches when path, size and mtime are unchanged or, if content
+  hashing is enabled, when the file content hash is the same (file was
+  touched, copied or moved).
+  New results are appended to the file as they are flushed, so an interrupted
+  run keeps what it did; compact() rewrites it with the entries used by
+  this run only.
+  Entries keep their values by column name: a run with other analyzers
+  still finds the files whose entries have all of its columns, and columns
+  of other analyzers stay with the entry while the file is unchanged.
+  Entries also keep the decode settings they were made with
+  (resultSettings()): a run with another analysis rate, channel mode or
+  segment mode doesn't find them.
+ *
+ */
+class AnalysisCache
+{
+    struct Entry
+    {
+        CacheKey key;
+        int64_t duration;
+        unsigned frequency;
+        std::string settings;
+        std::vector<std::pair<std::string, std::string>> values;   // column, value
+    };
+    std::string path;
+    // of the run's analyzers
+    std::vector<std::string> columns;
+    // of the run's decode, see resultSettings()
+    std::string settings;
+    std::ofstream log;
+    std::mutex m;
+    std::unordered_map<std::string, Entry> byPath;
+    std::unordered_multimap<uint64_t, std::string> byHash;
+    std::unordered_set<std::string> used;
+    size_t hits{0};
+public:
+    // columns - of the enabled analyzers, in CSV order; settings - resultSettings() of the run
+    AnalysisCache(const std::string &path, const std::vector<std::string> &columns, const std::string &settings);
+
+    /**
+      Find the result stored for key; a content hash in key (if any) is used
+      when path/size/mtime don't match. A stored entry without one of the
+      columns or of other settings doesn't match. result.name is left to the caller.
+     *
+     */
+    bool lookup(const CacheKey &key, AnalysisResult &result);
+    // appended to the file, call flush() to make sure it is on disk
+    void store(const CacheKey &key, const AnalysisResult &result);
+    void flush();
+    // rewrite the file keeping only entries looked up or stored in this run
+    void compact();
+    size_t hitCount() const { return hits; }
+private:
+    void add(Entry entry);
+    bool toResult(const Entry &entry, AnalysisResult &result) const;
+    // replace the file with the entries of paths
+    void rewrite(const std::vector<std::string> &paths);
+};
+
+// stat() based part of the key, throws std::runtime_error
+CacheKey cacheKeyOf(const std::string &path);
+
+// fast non-cryptographic 64 bit hash of the file content
+uint64_t contentHash(const InputBuffer &buf);
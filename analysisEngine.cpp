@@ -0,0 +1,97 @@
+#include "analysisEngine.h"
+#include "analysis.h"
+#include "fftWisdom.h"
+#include "metrics.h"
+#include "worker.h"
+
+using namespace std;
+
+// one submitted file on the pool
+class AnalysisEngine::Task
+{
+    AnalysisEngine &engine;
+    string name;
+    unique_ptr<InputBuffer> input;
+    Callback done;
+public:
+    Task(AnalysisEngine &engine, string name, unique_ptr<InputBuffer> input, Callback done)
+        : engine(engine), name(move(name)), input(move(input)), done(move(done)) {}
+    Task(Task &&) = default;
+
+    void operator()() {
+        AnalysisResult result;
+        exception_ptr error;
+        try {
+            bool cacheable;
+            result = analyzeFile(*input, name, engine.settings.decode, engine.pool.get(), nullptr, cacheable);
+            ++Metrics::global().filesAnalyzed;
+        } catch (...) {
+            ++Metrics::global().filesFailed;
+            error = current_exception();
+            result = AnalysisResult{name, 0, 0, {}};
+        }
+        // counted as finished also if the callback throws (the pool keeps the exception)
+        struct Finish {
+            AnalysisEngine &engine;
+            ~Finish() { engine.finished(); }
+        } finish{engine};
+        done(move(result), error);
+    }
+    size_t inputSize() const { return input->size(); }
+};
+
+AnalysisEngine::AnalysisEngine(Settings s) : settings(move(s))
+{
+    columns_ = analyzerColumns(settings.decode.analyzers);
+    makeFftPlannerThreadSafe();
+    size_t threads = settings.threads ? settings.threads : max<size_t>(thread::hardware_concurrency(), 1);
+    size_t depth = settings.queueDepth ? settings.queueDepth : 2 * threads;
+    pool = make_unique<ThreadPool>(threads, depth, settings.queueBytes);
+}
+
+AnalysisEngine::~AnalysisEngine()
+{
+    wait();
+}
+
+void AnalysisEngine::submit(string name, unique_ptr<InputBuffer> input, Callback done)
+{
+    {
+        lock_guard<mutex> l(m);
+        ++running;
+    }
+    pool->submit(Task(*this, move(name), move(input), move(done)));
+}
+
+void AnalysisEngine::submit(string name, vector<char> data, Callback done)
+{
+    submit(move(name), make_unique<MemoryBuffer>(move(data)), move(done));
+}
+
+future<AnalysisResult> AnalysisEngine::submit(string name, vector<char> data)
+{
+    auto promise = make_shared<std::promise<AnalysisResult>>();
+    auto result = promise->get_future();
+    submit(move(name), move(data), [promise](AnalysisResult r, exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(move(r));
+        }
+    });
+    return result;
+}
+
+void AnalysisEngine::wait()
+{
+    unique_lock<mutex> l(m);
+    idle.wait(l, [&] { return running == 0; });
+}
+
+void AnalysisEngine::finished()
+{
+    lock_guard<mutex> l(m);
+    if (--running == 0) {
+        idle.notify_all();
+    }
+}
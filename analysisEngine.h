@@ -0,0 +1,74 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "decodeAudio.h"
+#include "inputBuffer.h"
+#include "result.h"
+
+class ThreadPool;
+
+/**
+  Entry point of the analysis library for programs that analyze audio
+  themselves instead of running AudioAnalyzer on a folder: files are handed
+  over in memory and analyzed on a pool of threads that stays up between
+  files, so every thread sets up its decoder, resampler and FFT plans once.
+  Results come back through a callback or a future; nothing is written to
+  disk and no cache is kept (the caller knows its files better).
+  Long files are split across the threads as in a folder run.
+ *
+ */
+class AnalysisEngine
+{
+public:
+    struct Settings
+    {
+        // analyzers, analysis rate, channels, segments
+        DecodeOptions decode;
+        size_t threads{0};                      // 0 = one per core
+        size_t queueDepth{0};                   // files waiting for a thread, 0 = 2 per thread
+        size_t queueBytes{size_t(256) << 20};   // input held by waiting and running files
+    };
+    // called on a pool thread once the file is done: its result, or error set and only result.name
+    using Callback = std::function<void(AnalysisResult result, std::exception_ptr error)>;
+
+    // throws std::invalid_argument for unknown analyzers
+    explicit AnalysisEngine(Settings settings);
+    AnalysisEngine(const AnalysisEngine &) = delete;
+    AnalysisEngine & operator=(const AnalysisEngine &) = delete;
+    // waits for the files submitted
+    ~AnalysisEngine();
+
+    // names of AnalysisResult::values, in the order of the analyzers in the settings
+    const std::vector<std::string> & columns() const { return columns_; }
+    /**
+      Queue a file, name is only passed through to the result.
+      Blocks while the queue depth or byte budget is exhausted, so done
+      must not wait for another file of this engine
+     *
+     */
+    void submit(std::string name, std::unique_ptr<InputBuffer> input, Callback done);
+    void submit(std::string name, std::vector<char> data, Callback done);
+    // the result, or the analysis' exception thrown by get()
+    std::future<AnalysisResult> submit(std::string name, std::vector<char> data);
+    // until the callbacks of all files submitted so far returned
+    void wait();
+
+    class Task;
+private:
+    Settings settings;
+    std::vector<std::string> columns_;
+    std::mutex m;
+    std::condition_variable idle;
+    size_t running{0};
+    // last: its threads are joined before the rest goes
+    std::unique_ptr<ThreadPool> pool;
+
+    void finished();
+};
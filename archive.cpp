@@ -0,0 +1,377 @@
+#include "archive.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+static uint16_t le16(const uint8_t *p) { return uint16_t(p[0] | p[1] << 8); }
+static uint32_t le32(const uint8_t *p) { return uint32_t(le16(p)) | uint32_t(le16(p + 2)) << 16; }
+static uint64_t le64(const uint8_t *p) { return uint64_t(le32(p)) | uint64_t(le32(p + 4)) << 32; }
+
+namespace {
+
+// stored member: a slice of the mapped archive, which it keeps mapped
+class ArchiveSlice : public InputBuffer
+{
+    shared_ptr<MappedFile> file;
+    const uint8_t *p;
+    size_t n;
+public:
+    ArchiveSlice(shared_ptr<MappedFile> f, uint64_t offset, uint64_t size)
+        : file(move(f)), p(file->data() + offset), n(size_t(size)) {}
+    const uint8_t *data() const override { return p; }
+    size_t size() const override { return n; }
+};
+
+/**
+  Deflated member, inflated on first access: that is on the worker thread
+  decoding it, not on the thread handing out the files. The pieces of a
+  split file share one, so inflating is done once
+ *
+ */
+class InflatedMember : public InputBuffer
+{
+    shared_ptr<MappedFile> file;
+    ArchiveMember member;
+    mutable once_flag once;
+    mutable vector<char> buf;
+public:
+    InflatedMember(shared_ptr<MappedFile> f, ArchiveMember m) : file(move(f)), member(move(m)) {}
+    ~InflatedMember() override { BufferPool::give(move(buf)); }
+    const uint8_t *data() const override {
+        call_once(once, [this] { inflate(); });
+        return reinterpret_cast<const uint8_t *>(buf.data());
+    }
+    size_t size() const override { return size_t(member.size); }
+private:
+    void inflate() const;
+};
+
+}
+
+/**
+  Inflate raw deflate data into out, stopping when it is full;
+  returns the zlib status and the bytes written
+ *
+ */
+static int inflateRaw(const uint8_t *in, uint64_t inSize, uint8_t *out, size_t outSize, size_t &written)
+{
+    z_stream zs{};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        throw runtime_error("can't initialize zlib");
+    }
+    // avail_in and avail_out are 32 bit: big members go in steps
+    int status = Z_OK;
+    written = 0;
+    while (status == Z_OK && written < outSize) {
+        if (zs.avail_in == 0 && inSize > 0) {
+            zs.next_in = const_cast<Bytef *>(in);
+            zs.avail_in = uInt(min<uint64_t>(inSize, UINT_MAX));
+            in += zs.avail_in;
+            inSize -= zs.avail_in;
+        }
+        size_t step = min<size_t>(outSize - written, UINT_MAX);
+        zs.next_out = out + written;
+        zs.avail_out = uInt(step);
+        status = ::inflate(&zs, Z_NO_FLUSH);
+        written += step - zs.avail_out;
+        if (status == Z_BUF_ERROR && zs.avail_in == 0 && inSize > 0) {
+            status = Z_OK;
+        }
+    }
+    inflateEnd(&zs);
+    return status;
+}
+
+void InflatedMember::inflate() const
+{
+    buf = BufferPool::take(size_t(member.size));
+    size_t written;
+    int status = inflateRaw(file->data() + member.offset, member.packedSize,
+                            reinterpret_cast<uint8_t *>(buf.data()), buf.size(), written);
+    // a stream that ends early, or doesn't end where it should
+    bool ended = status == Z_STREAM_END || (status == Z_OK && member.size == 0);
+    if (!ended || written != member.size) {
+        throw runtime_error("damaged archive member " + member.name + (status == Z_DATA_ERROR ? ": bad deflate data" : ""));
+    }
+    if (uint32_t(crc32_z(0, reinterpret_cast<const Bytef *>(buf.data()), buf.size())) != member.crc) {
+        throw runtime_error("damaged archive member " + member.name + ": bad CRC");
+    }
+}
+
+Archive::Archive(const string &path) : path_(path)
+{
+    // members are read in any order: no readahead of the whole archive
+    file = make_shared<MappedFile>(path, false);
+    const uint8_t *p = file->data();
+    size_t size = file->size();
+    if (size >= 4 && p[0] == 'P' && p[1] == 'K' && ((p[2] == 3 && p[3] == 4) || (p[2] == 5 && p[3] == 6))) {
+        readZip();
+    } else if (size >= 262 && memcmp(p + 257, "ustar", 5) == 0) {
+        readTar();
+    } else if (size >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        throw runtime_error(path + " is gzip compressed, which can't be read in place: unpack it to a plain tar first");
+    } else {
+        throw runtime_error(path + " is neither a folder nor a tar or zip archive");
+    }
+}
+
+bool Archive::isArchive(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// octal, or base 256 if the high bit is set (GNU, for sizes of 8 GB and more)
+static uint64_t tarNumber(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x7f;
+        for (size_t i = 1; i < n; ++i) {
+            v = v << 8 | p[i];
+        }
+        return v;
+    }
+    size_t i = 0;
+    while (i < n && p[i] == ' ') ++i;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; ++i) {
+        v = v * 8 + (p[i] - '0');
+    }
+    return v;
+}
+
+static string tarField(const uint8_t *p, size_t n)
+{
+    auto s = reinterpret_cast<const char *>(p);
+    return string(s, strnlen(s, n));
+}
+
+// path of a pax extended header ("<length> path=<value>\n" records), empty if it has none
+static string paxPath(const uint8_t *p, size_t n)
+{
+    string path;
+    size_t i = 0;
+    while (i < n) {
+        size_t length = 0, j = i;
+        while (j < n && p[j] >= '0' && p[j] <= '9') {
+            length = length * 10 + (p[j++] - '0');
+        }
+        if (length == 0 || i + length > n || j >= n || p[j] != ' ') {
+            break;
+        }
+        string record(reinterpret_cast<const char *>(p) + j + 1, i + length - j - 2);
+        if (record.compare(0, 5, "path=") == 0) {
+            path = record.substr(5);
+        }
+        i += length;
+    }
+    return path;
+}
+
+void Archive::readTar()
+{
+    const uint8_t *data = file->data();
+    uint64_t size = file->size();
+    // name for the next header, from a GNU long name or pax header before it
+    string longName;
+    uint64_t pos = 0;
+    while (pos + 512 <= size) {
+        const uint8_t *h = data + pos;
+        if (all_of(h, h + 512, [](uint8_t b) { return b == 0; })) {
+            break;
+        }
+        // the checksum counts its own field as spaces
+        uint64_t sum = 0;
+        for (size_t i = 0; i < 512; ++i) {
+            sum += i >= 148 && i < 156 ? ' ' : h[i];
+        }
+        if (sum != tarNumber(h + 148, 8)) {
+            throw runtime_error("damaged tar archive " + path_ + ": bad header at offset " + to_string(pos));
+        }
+        uint64_t length = tarNumber(h + 124, 12);
+        uint64_t start = pos + 512;
+        if (length > size - start) {
+            throw runtime_error("truncated tar archive " + path_);
+        }
+        pos = start + (length + 511) / 512 * 512;
+        char type = char(h[156]);
+        if (type == 'L') {
+            longName = tarField(data + start, length);
+            continue;
+        }
+        if (type == 'x') {
+            longName = paxPath(data + start, length);
+            continue;
+        }
+        string name = longName;
+        longName.clear();
+        // regular files only: folders, links and devices are no audio
+        if (type != '0' && type != '\0' && type != '7') {
+            continue;
+        }
+        if (name.empty()) {
+            name = tarField(h, 100);
+            string prefix = tarField(h + 345, 155);
+            if (!prefix.empty()) {
+                name = prefix + "/" + name;
+            }
+        }
+        // tar . writes ./name
+        while (name.compare(0, 2, "./") == 0) {
+            name.erase(0, 2);
+        }
+        ArchiveMember m{name, start, length, length, int64_t(tarNumber(h + 136, 12)) * 1000000000,
+                        0, ArchiveMember::Compression::Stored, {}};
+        members_.push_back(move(m));
+    }
+}
+
+// DOS date and time of a zip entry, local time
+static int64_t dosTime(uint16_t date, uint16_t time)
+{
+    tm t{};
+    t.tm_year = (date >> 9) + 80;
+    t.tm_mon = ((date >> 5) & 15) - 1;
+    t.tm_mday = date & 31;
+    t.tm_hour = time >> 11;
+    t.tm_min = (time >> 5) & 63;
+    t.tm_sec = (time & 31) * 2;
+    t.tm_isdst = -1;
+    return int64_t(mktime(&t)) * 1000000000;
+}
+
+void Archive::readZip()
+{
+    const uint8_t *data = file->data();
+    uint64_t size = file->size();
+    auto damaged = [&](const string &what) { return runtime_error("damaged zip archive " + path_ + ": " + what); };
+    // the end of central directory record, followed by a comment of up to 64 KB
+    if (size < 22) {
+        throw damaged("too short");
+    }
+    uint64_t end = size - 22;
+    uint64_t last = size > 22 + 65535 ? size - 22 - 65535 : 0;
+    while (le32(data + end) != 0x06054b50) {
+        if (end == last) {
+            throw damaged("no central directory");
+        }
+        --end;
+    }
+    uint64_t entries = le16(data + end + 10);
+    uint64_t directorySize = le32(data + end + 12);
+    uint64_t directory = le32(data + end + 16);
+    // zip64: the real values are in the zip64 end record, found by the locator before this one
+    if (end >= 20 && le32(data + end - 20) == 0x07064b50) {
+        uint64_t end64 = le64(data + end - 20 + 8);
+        if (end64 > size - 56 || le32(data + end64) != 0x06064b50) {
+            throw damaged("bad zip64 end record");
+        }
+        entries = le64(data + end64 + 32);
+        directorySize = le64(data + end64 + 40);
+        directory = le64(data + end64 + 48);
+    }
+    if (directory > size || directorySize > size - directory) {
+        throw damaged("central directory out of range");
+    }
+    uint64_t pos = directory, directoryEnd = directory + directorySize;
+    for (uint64_t i = 0; i < entries; ++i) {
+        if (directoryEnd - pos < 46 || le32(data + pos) != 0x02014b50) {
+            throw damaged("bad central directory entry");
+        }
+        const uint8_t *e = data + pos;
+        uint16_t flags = le16(e + 8), method = le16(e + 10);
+        uint64_t packed = le32(e + 20), length = le32(e + 24), local = le32(e + 42);
+        size_t nameLength = le16(e + 28), extraLength = le16(e + 30), commentLength = le16(e + 32);
+        uint64_t next = pos + 46 + nameLength + extraLength + commentLength;
+        if (next > directoryEnd) {
+            throw damaged("bad central directory entry");
+        }
+        string name(reinterpret_cast<const char *>(e + 46), nameLength);
+        int64_t mtime = dosTime(le16(e + 14), le16(e + 12));
+        // extra fields: zip64 sizes and offset (only those set to all ones here), unix time
+        const uint8_t *x = e + 46 + nameLength, *xEnd = x + extraLength;
+        while (xEnd - x >= 4) {
+            uint16_t id = le16(x), n = le16(x + 2);
+            const uint8_t *v = x + 4, *vEnd = v + min<ptrdiff_t>(n, xEnd - v);
+            if (id == 0x0001) {
+                for (uint64_t *field : {&length, &packed, &local}) {
+                    if (*field == 0xFFFFFFFF && vEnd - v >= 8) {
+                        *field = le64(v);
+                        v += 8;
+                    }
+                }
+            } else if (id == 0x5455 && vEnd - v >= 5 && (v[0] & 1)) {
+                mtime = int64_t(int32_t(le32(v + 1))) * 1000000000;
+            }
+            x = vEnd;
+        }
+        pos = next;
+        if (name.empty() || name.back() == '/') {
+            continue;
+        }
+        if (local > size - 30 || le32(data + local) != 0x04034b50) {
+            throw damaged("bad local header of " + name);
+        }
+        uint64_t start = local + 30 + le16(data + local + 26) + le16(data + local + 28);
+        if (start > size || packed > size - start) {
+            throw damaged(name + " out of range");
+        }
+        ArchiveMember m{name, start, length, packed, mtime, le32(e + 16), ArchiveMember::Compression::Stored, {}};
+        if (flags & 1) {
+            m.compression = ArchiveMember::Compression::Unsupported;
+            m.problem = "encrypted";
+        } else if (method == 8) {
+            m.compression = ArchiveMember::Compression::Deflated;
+        } else if (method != 0) {
+            m.compression = ArchiveMember::Compression::Unsupported;
+            m.problem = "compression method " + to_string(method) + " is not supported";
+        } else if (packed != length) {
+            throw damaged(name + " has a wrong size");
+        }
+        members_.push_back(move(m));
+    }
+}
+
+unique_ptr<InputBuffer> Archive::open(size_t index, bool wholeFile) const
+{
+    const ArchiveMember &m = members_.at(index);
+    switch (m.compression) {
+    case ArchiveMember::Compression::Stored:
+        if (wholeFile && m.size > 0) {
+            // readahead of this member only, as for a file of its own
+            uintptr_t page = uintptr_t(sysconf(_SC_PAGESIZE));
+            uintptr_t first = uintptr_t(file->data() + m.offset) & ~(page - 1);
+            uintptr_t last = uintptr_t(file->data() + m.offset + m.size);
+            madvise(reinterpret_cast<void *>(first), last - first, MADV_WILLNEED);
+        }
+        return make_unique<ArchiveSlice>(file, m.offset, m.size);
+    case ArchiveMember::Compression::Deflated:
+        return make_unique<InflatedMember>(file, m);
+    default:
+        throw runtime_error(m.name + ": " + m.problem);
+    }
+}
+
+size_t Archive::peek(size_t index, uint8_t *head, size_t size) const
+{
+    const ArchiveMember &m = members_.at(index);
+    size = size_t(min<uint64_t>(size, m.size));
+    if (m.compression == ArchiveMember::Compression::Stored) {
+        memcpy(head, file->data() + m.offset, size);
+        return size;
+    }
+    size_t written = 0;
+    if (m.compression == ArchiveMember::Compression::Deflated) {
+        inflateRaw(file->data() + m.offset, m.packedSize, head, size, written);
+    }
+    return written;
+}
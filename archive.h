@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "inputBuffer.h"
+
+// one file inside a tar or zip archive
+struct ArchiveMember
+{
+    enum class Compression { Stored, Deflated, Unsupported };
+
+    std::string name;           // path inside the archive
+    uint64_t offset;            // of its data in the archive
+    uint64_t size;              // of the file
+    uint64_t packedSize;        // bytes in the archive
+    int64_t mtime;              // nanoseconds since epoch
+    uint32_t crc;               // zip only
+    Compression compression;
+    std::string problem;        // why it can't be read (Unsupported)
+};
+
+/**
+  Tar or zip archive read in place: the archive is mapped once and its
+  members are handed to the decoders as slices of the mapping, so nothing
+  is extracted to disk or copied. Deflated zip members are inflated into
+  memory by the task that decodes them, so inflating runs in parallel too.
+  Compressed tar streams (.tar.gz) can't be read in place: no random access
+ *
+ */
+class Archive
+{
+    std::string path_;
+    std::shared_ptr<MappedFile> file;
+    std::vector<ArchiveMember> members_;
+public:
+    // reads the member list; throws std::runtime_error if path is no tar or zip archive or is damaged
+    explicit Archive(const std::string &path);
+
+    const std::string & path() const { return path_; }
+    const std::vector<ArchiveMember> & members() const { return members_; }
+    /**
+      Contents of member index; wholeFile = false: only the headers will be
+      read, no readahead. Deflated members are inflated on first access,
+      which throws std::runtime_error if the data is damaged
+     *
+     */
+    std::unique_ptr<InputBuffer> open(size_t index, bool wholeFile = true) const;
+    // up to size first bytes of member index (signature check), returns the count
+    size_t peek(size_t index, uint8_t *head, size_t size) const;
+
+    // path is a file, not a folder: read it as an archive
+    static bool isArchive(const std::string &path);
+private:
+    void readTar();
+    void readZip();
+};
@@ -0,0 +1,354 @@
+#include "audioFeatures.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <fftw3.h>
+
+using namespace std;
+
+static string decibels(double db)
+{
+    if (isinf(db)) {
+        return "-inf";
+    }
+    char text[16];
+    snprintf(text, sizeof text, "%.2f", db);
+    return text;
+}
+
+void LoudnessMeter::begin(const AudioInfo &info)
+{
+    setup(info.sampleRate, info.channels);
+    frameCount = 0;
+    energy.fill(0);
+    blocks.fill(0);
+    loudness.clear();
+    gain.clear();
+}
+
+void LoudnessMeter::setup(unsigned r, unsigned ch)
+{
+    // K-weighting for any rate: BS.1770's 48 kHz filters are a high shelf and
+    // a high pass, derived again here from their analog prototypes (bilinear transform)
+    if (r != rate && r > 0) {
+        double k = tan(M_PI * 1681.974450955533 / r), q = 0.7071752369554196;
+        double vh = pow(10, 3.999843853973347 / 20), vb = pow(vh, 0.4996667741545416);
+        double a0 = 1 + k / q + k * k;
+        shelf = {(vh + vb * k / q + k * k) / a0, 2 * (k * k - vh) / a0, (vh - vb * k / q + k * k) / a0,
+                 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0};
+        k = tan(M_PI * 38.13547087602444 / r);
+        q = 0.5003270373238773;
+        a0 = 1 + k / q + k * k;
+        highPass = {1, -2, 1, 2 * (k * k - 1) / a0, (1 - k / q + k * k) / a0};
+        stepFrames = max<size_t>(r / 10, 1);
+    }
+    rate = r;
+    channels = ch;
+    state.assign(ch, {0, 0, 0, 0});
+    weights.assign(ch, 1.0);
+    if (ch == 5 || ch == 6) {
+        // FL FR FC (LFE) SL SR
+        weights[ch - 2] = weights[ch - 1] = 1.41;
+        if (ch == 6) {
+            weights[3] = 0;
+        }
+    }
+    // a block never spans a change of format
+    stepFill = 0;
+    stepEnergy = 0;
+    stepCount = 0;
+}
+
+void LoudnessMeter::writeFrames(const float *samples, size_t frames, unsigned ch, unsigned r)
+{
+    if (ch != channels || r != rate) {
+        setup(r, ch);
+    }
+    frameCount += frames;
+    for (size_t i = 0; i < frames; ++i, samples += ch) {
+        double sum = 0;
+        for (unsigned c = 0; c < ch; ++c) {
+            auto &z = state[c];
+            double x = samples[c];
+            double y = shelf.b0 * x + z[0];
+            z[0] = shelf.b1 * x - shelf.a1 * y + z[1];
+            z[1] = shelf.b2 * x - shelf.a2 * y;
+            x = y;
+            y = highPass.b0 * x + z[2];
+            z[2] = highPass.b1 * x - highPass.a1 * y + z[3];
+            z[3] = highPass.b2 * x - highPass.a2 * y;
+            sum += weights[c] * y * y;
+        }
+        stepEnergy += sum;
+        if (++stepFill == stepFrames) {
+            steps[stepCount++ % steps.size()] = stepEnergy / stepFrames;
+            stepFill = 0;
+            stepEnergy = 0;
+            // a 400 ms block ends every 100 ms
+            if (stepCount >= steps.size()) {
+                addBlock((steps[0] + steps[1] + steps[2] + steps[3]) / 4);
+            }
+        }
+    }
+}
+
+void LoudnessMeter::addBlock(double z)
+{
+    double lufs = -0.691 + 10 * log10(z);
+    if (!(lufs >= minLufs)) {
+        return;
+    }
+    size_t bin = min(size_t((lufs - minLufs) / binWidth), bins - 1);
+    energy[bin] += z;
+    ++blocks[bin];
+}
+
+void LoudnessMeter::end()
+{
+    if (!piece) {
+        finish();
+    }
+}
+
+void LoudnessMeter::merge(Analyzer &other)
+{
+    auto &p = static_cast<LoudnessMeter &>(other);
+    for (size_t i = 0; i < bins; ++i) {
+        energy[i] += p.energy[i];
+        blocks[i] += p.blocks[i];
+    }
+    frameCount += p.frameCount;
+}
+
+void LoudnessMeter::finish()
+{
+    if (frameCount == 0) {
+        throw runtime_error("no samples found!");
+    }
+    // mean energy of the blocks in bins from first on
+    auto mean = [&](size_t first) {
+        double e = 0;
+        uint64_t n = 0;
+        for (size_t i = first; i < bins; ++i) {
+            e += energy[i];
+            n += blocks[i];
+        }
+        return n ? e / n : 0.0;
+    };
+    double ungated = mean(0);
+    if (ungated <= 0) {
+        loudness = "-inf";
+        gain.clear();
+        return;
+    }
+    // bins whose centre is above the relative gate
+    double gate = -0.691 + 10 * log10(ungated) - 10;
+    double first = ceil((gate - minLufs) / binWidth - 0.5);
+    double lufs = -0.691 + 10 * log10(mean(size_t(max(first, 0.0))));
+    loudness = decibels(lufs);
+    gain = decibels(-18 - lufs);
+}
+
+void LoudnessMeter::values(vector<string> &out) const
+{
+    out.push_back(loudness);
+    out.push_back(gain);
+}
+
+void LevelMeter::begin(const AudioInfo &)
+{
+    peak = 0;
+    squares = 0;
+    samples = 0;
+    peakText.clear();
+    rmsText.clear();
+}
+
+void LevelMeter::writeFrames(const float *s, size_t frames, unsigned channels, unsigned)
+{
+    size_t n = frames * channels;
+    float p = peak;
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        p = max(p, fabs(s[i]));
+        sum += double(s[i]) * s[i];
+    }
+    peak = p;
+    squares += sum;
+    samples += n;
+}
+
+void LevelMeter::end()
+{
+    if (!piece) {
+        finish();
+    }
+}
+
+void LevelMeter::merge(Analyzer &other)
+{
+    auto &p = static_cast<LevelMeter &>(other);
+    peak = max(peak, p.peak);
+    squares += p.squares;
+    samples += p.samples;
+}
+
+void LevelMeter::finish()
+{
+    if (samples == 0) {
+        throw runtime_error("no samples found!");
+    }
+    peakText = decibels(peak > 0 ? 20 * log10(peak) : -HUGE_VAL);
+    rmsText = decibels(squares > 0 ? 10 * log10(squares / samples) : -HUGE_VAL);
+}
+
+void LevelMeter::values(vector<string> &out) const
+{
+    out.push_back(peakText);
+    out.push_back(rmsText);
+}
+
+/**
+  FFTW plan of SpectralCentroid's frame size, single precision r2c on
+  fftwf_malloc'ed buffers out of place: the problem prepareFftWisdom()
+  measures, so a run with --fft-wisdom gets the measured plan
+ *
+ */
+struct CentroidFft
+{
+    size_t size;
+    float *in;
+    fftwf_complex *out;
+    fftwf_plan plan;
+
+    explicit CentroidFft(size_t n);
+    ~CentroidFft();
+    // |X[k]| of in, for k = 0..size/2
+    void magnitudes(float *m);
+};
+
+CentroidFft::CentroidFft(size_t n) : size(n)
+{
+    in = static_cast<float *>(fftwf_malloc(sizeof(float) * n));
+    out = static_cast<fftwf_complex *>(fftwf_malloc(sizeof(fftwf_complex) * (n / 2 + 1)));
+    // the planner is shared with aubio's, see makeFftPlannerThreadSafe()
+    plan = fftwf_plan_dft_r2c_1d(int(n), in, out, FFTW_ESTIMATE);
+    if (!plan) {
+        fftwf_free(in);
+        fftwf_free(out);
+        throw runtime_error("can't plan a " + to_string(n) + " point FFT");
+    }
+}
+
+CentroidFft::~CentroidFft()
+{
+    fftwf_destroy_plan(plan);
+    fftwf_free(in);
+    fftwf_free(out);
+}
+
+void CentroidFft::magnitudes(float *m)
+{
+    fftwf_execute(plan);
+    for (size_t k = 0; k <= size / 2; ++k) {
+        m[k] = hypot(out[k][0], out[k][1]);
+    }
+}
+
+void SpectralCentroid::begin(const AudioInfo &info)
+{
+    setup(info.sampleRate);
+    sum = 0;
+    count = 0;
+    result.clear();
+}
+
+void SpectralCentroid::setup(unsigned r)
+{
+    // about 46 ms, the same resolution in Hz at every rate
+    size_t size = 2048;
+    while (r > size * 32) {
+        size *= 2;
+    }
+    if (!ctx.centroidFft || ctx.centroidFft->size != size) {
+        ctx.centroidFft = make_shared<CentroidFft>(size);
+    }
+    if (size != frameSize) {
+        frameSize = size;
+        window.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            window[i] = float(0.5 - 0.5 * cos(2 * M_PI * i / size));
+        }
+        magnitudes.resize(size / 2 + 1);
+    }
+    rate = r;
+    fill = 0;
+}
+
+void SpectralCentroid::writeFrames(const float *samples, size_t frames, unsigned channels, unsigned r)
+{
+    if (r != rate) {
+        setup(r);
+    }
+    float scale = 1.0f / channels;
+    for (size_t i = 0; i < frames; ++i, samples += channels) {
+        float mix = 0;
+        for (unsigned c = 0; c < channels; ++c) {
+            mix += samples[c];
+        }
+        ctx.centroidFft->in[fill] = mix * scale;
+        if (++fill == frameSize) {
+            analyzeFrame();
+            fill = 0;
+        }
+    }
+}
+
+void SpectralCentroid::analyzeFrame()
+{
+    CentroidFft &fft = *ctx.centroidFft;
+    double power = 0;
+    for (size_t i = 0; i < frameSize; ++i) {
+        power += double(fft.in[i]) * fft.in[i];
+        fft.in[i] *= window[i];
+    }
+    if (power < 1e-6 * frameSize) {
+        return;
+    }
+    fft.magnitudes(magnitudes.data());
+    // without DC: an offset is no sound
+    double weighted = 0, total = 0;
+    for (size_t k = 1; k < magnitudes.size(); ++k) {
+        weighted += double(k) * magnitudes[k];
+        total += magnitudes[k];
+    }
+    if (total > 0) {
+        sum += weighted / total * rate / frameSize;
+        ++count;
+    }
+}
+
+void SpectralCentroid::end()
+{
+    if (!piece) {
+        finish();
+    }
+}
+
+void SpectralCentroid::merge(Analyzer &other)
+{
+    auto &p = static_cast<SpectralCentroid &>(other);
+    sum += p.sum;
+    count += p.count;
+}
+
+void SpectralCentroid::finish()
+{
+    result.clear();
+    if (count > 0) {
+        char text[16];
+        snprintf(text, sizeof text, "%.0f", sum / count);
+        result = text;
+    }
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "analysis.h"
+
+/**
+  Integrated loudness after EBU R128 (ITU-R BS.1770): K-weighted channels
+  in 400 ms blocks with 75% overlap, gated at -70 LUFS and at 10 LU below
+  the mean of the blocks above that. Measured on the file's own channels
+  at its own rate. Blocks go into 0.1 LU bins that keep their energy, so
+  memory is fixed, pieces of a split file merge, and the relative gate
+  is applied with bin precision.
+  Channels are weighted in FFmpeg's default order: the surround pair of
+  5 and 6 channel files +1.5 dB, the LFE left out.
+  ReplayGain is the gain to the ReplayGain 2.0 reference level of -18 LUFS
+ *
+ */
+class LoudnessMeter : public Analyzer
+{
+public:
+    static constexpr double minLufs = -70;     // absolute gate
+    static constexpr double maxLufs = 10;
+    static constexpr double binWidth = 0.1;
+    static constexpr size_t bins = size_t((maxLufs - minLufs) / binWidth);
+
+    void begin(const AudioInfo &info) override;
+    // the analysis stream is not used
+    void write(const float *, size_t) override {}
+    void end() override;
+    bool wantsFrames() const override { return true; }
+    void writeFrames(const float *samples, size_t frames, unsigned channels, unsigned rate) override;
+
+    void setPiece() override { piece = true; }
+    void merge(Analyzer &piece) override;
+    void finish() override;
+    // Loudness (LUFS), ReplayGain (dB); -inf and empty for digital silence
+    void values(std::vector<std::string> &out) const override;
+private:
+    // transposed direct form II, a0 = 1
+    struct Biquad { double b0, b1, b2, a1, a2; };
+    Biquad shelf{}, highPass{};
+    unsigned rate{0};
+    unsigned channels{0};
+    // per channel: two delays of each filter
+    std::vector<std::array<double, 4>> state;
+    std::vector<double> weights;
+    size_t stepFrames{0};       // 100 ms, a quarter block
+    size_t stepFill{0};
+    double stepEnergy{0};
+    std::array<double, 4> steps{};
+    size_t stepCount{0};
+    uint64_t frameCount{0};
+    std::array<double, bins> energy{};      // sum of the block energies in each bin
+    std::array<uint32_t, bins> blocks{};
+    bool piece{false};
+    std::string loudness;
+    std::string gain;
+
+    void setup(unsigned rate, unsigned channels);
+    void addBlock(double z);
+};
+
+/**
+  Sample peak and RMS level over all channels of the file, in dBFS
+ *
+ */
+class LevelMeter : public Analyzer
+{
+    float peak{0};
+    double squares{0};
+    uint64_t samples{0};
+    bool piece{false};
+    std::string peakText;
+    std::string rmsText;
+public:
+    void begin(const AudioInfo &info) override;
+    void write(const float *, size_t) override {}
+    void end() override;
+    bool wantsFrames() const override { return true; }
+    void writeFrames(const float *samples, size_t frames, unsigned channels, unsigned rate) override;
+
+    void setPiece() override { piece = true; }
+    void merge(Analyzer &piece) override;
+    void finish() override;
+    // Peak, RMS
+    void values(std::vector<std::string> &out) const override;
+};
+
+/**
+  Spectral centroid (brightness) in Hz: the magnitude weighted mean
+  frequency of Hann windowed frames of about 46 ms of the channel mix at
+  the file's rate, averaged over the frames above -60 dBFS. Taken before
+  resampling, a low --analysis-rate would cut the highs off
+ *
+ */
+class SpectralCentroid : public Analyzer
+{
+    AnalysisContext &ctx;
+    unsigned rate{0};
+    size_t frameSize{0};
+    // of the frame in the context's FFT input
+    size_t fill{0};
+    std::vector<float> window;
+    std::vector<float> magnitudes;
+    double sum{0};      // of the frames' centroids
+    size_t count{0};
+    bool piece{false};
+    std::string result;
+public:
+    explicit SpectralCentroid(AnalysisContext &ctx = AnalysisContext::local()) : ctx(ctx) {}
+    void begin(const AudioInfo &info) override;
+    void write(const float *, size_t) override {}
+    void end() override;
+    bool wantsFrames() const override { return true; }
+    void writeFrames(const float *samples, size_t frames, unsigned channels, unsigned rate) override;
+
+    void setPiece() override { piece = true; }
+    void merge(Analyzer &piece) override;
+    void finish() override;
+    // Centroid, empty if no frame was loud enough
+    void values(std::vector<std::string> &out) const override { out.push_back(result); }
+private:
+    void setup(unsigned rate);
+    void analyzeFrame();
+};
@@ -0,0 +1,92 @@
+//  Throughput of the sample conversion kernels (sampleConvert.cpp) in isolation:
+//  every sample type x layout x channel mode, for each instruction set this CPU has.
+//  Results of the SIMD kernels are checked against the scalar ones.
+//
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include "../sampleConvert.h"
+
+using namespace std;
+
+static const size_t frames = 4096;      // typical decoded frame is 1152..4608 samples
+static const double seconds = 0.2;      // per measurement
+
+struct Format {
+    const char *name;
+    SampleType type;
+    size_t bytes;
+};
+
+int main()
+{
+    const Format formats[] = {
+        {"u8", SampleType::U8, 1}, {"s16", SampleType::S16, 2}, {"s32", SampleType::S32, 4},
+        {"s64", SampleType::S64, 8}, {"flt", SampleType::FLT, 4}, {"dbl", SampleType::DBL, 8},
+    };
+    vector<Isa> isas{Isa::Scalar};
+    if (bestIsa() != Isa::Scalar) isas.push_back(Isa::SSE2);
+    if (bestIsa() == Isa::AVX2) isas.push_back(Isa::AVX2);
+
+    mt19937 rng(1);
+    vector<uint8_t> input(frames * 8 * 8 + 64);
+    for (auto &b : input) b = uint8_t(rng());
+
+    cout << "kernel                         ";
+    for (auto isa : isas) cout << setw(12) << isaName(isa);
+    cout << "   (Msamples/s)\n";
+    int failures = 0;
+    for (auto &f : formats) {
+        // floating point input must be sane values, not random bit patterns
+        if (f.type == SampleType::FLT) {
+            float *p = reinterpret_cast<float *>(input.data());
+            for (size_t i = 0; i < input.size() / 4; ++i) p[i] = float(int(rng() % 2001) - 1000) / 1000;
+        } else if (f.type == SampleType::DBL) {
+            double *p = reinterpret_cast<double *>(input.data());
+            for (size_t i = 0; i < input.size() / 8; ++i) p[i] = double(int(rng() % 2001) - 1000) / 1000;
+        }
+        for (bool planar : {false, true}) {
+            for (unsigned channels : {1u, 2u, 6u}) {
+                if (planar && channels == 1) continue;
+                for (ChannelMode mode : {ChannelMode::First, ChannelMode::Mix}) {
+                    if (channels == 1 && mode == ChannelMode::Mix) continue;
+                    const uint8_t *planes[8];
+                    for (unsigned c = 0; c < channels; ++c) {
+                        planes[c] = input.data() + (planar ? c * frames * f.bytes : 0);
+                    }
+                    string name = string(f.name) + (planar ? "p" : "") + " " + to_string(channels) + "ch " +
+                                  (mode == ChannelMode::Mix ? "mix" : "first");
+                    cout << left << setw(31) << name << right;
+                    vector<float> reference(frames), out(frames);
+                    selectConverter(f.type, planar, channels, mode, Isa::Scalar)(planes, channels, frames, reference.data());
+                    for (auto isa : isas) {
+                        ConvertFn fn = selectConverter(f.type, planar, channels, mode, isa);
+                        fn(planes, channels, frames, out.data());
+                        for (size_t i = 0; i < frames; ++i) {
+                            if (fabs(out[i] - reference[i]) > 1e-5f * (1 + fabs(reference[i]))) {
+                                cout << "\nMISMATCH " << isaName(isa) << " at " << i << ": " << out[i] << " != " << reference[i] << "\n";
+                                ++failures;
+                                break;
+                            }
+                        }
+                        size_t calls = 0;
+                        auto start = chrono::steady_clock::now();
+                        chrono::duration<double> elapsed{};
+                        do {
+                            for (int k = 0; k < 64; ++k) fn(planes, channels, frames, out.data());
+                            calls += 64;
+                            elapsed = chrono::steady_clock::now() - start;
+                        } while (elapsed.count() < seconds);
+                        cout << setw(12) << fixed << setprecision(0) << calls * frames * channels / elapsed.count() / 1e6;
+                    }
+                    cout << "\n";
+                }
+            }
+        }
+    }
+    return failures ? 1 : 0;
+}
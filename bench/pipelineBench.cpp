@@ -0,0 +1,312 @@
+//  End-to-end timings of the analysis pipeline, stage by stage, on a synthetic corpus.
+//  The corpus (sine, chord and click track WAVs at several rates) is generated
+//  deterministically on the first run and re-encoded to FLAC and MP3 if ffmpeg,
+//  flac or lame are installed. Files are analyzed one at a time on one thread,
+//  so every figure is per core.
+//
+//  pipelineBench [--corpus DIR] [--seconds S] [--repeat N] [--save FILE]
+//                [--baseline FILE] [--tolerance PERCENT]
+//
+//  --save writes the throughput figures as JSON; --baseline compares with such a
+//  file and exits with 1 if any figure dropped by more than the tolerance (default 10%).
+//
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../analysis.h"
+#include "../decodeAudio.h"
+#include "../inputBuffer.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+using Clock = chrono::steady_clock;
+
+struct Signal {
+    const char *name;
+    vector<double> tones;   // Hz
+    double bpm;             // 0 = no clicks
+};
+
+// C major chord under the click tracks, A minor without clicks
+static const Signal signals[] = {
+    {"sine", {440.0}, 0},
+    {"chord", {220.0, 261.63, 329.63}, 0},
+    {"click90", {261.63, 329.63, 392.0}, 90},
+    {"click128", {261.63, 329.63, 392.0}, 128},
+};
+
+static const struct { unsigned rate, channels; } layouts[] = {
+    {44100, 2}, {48000, 2}, {96000, 2}, {22050, 1},
+};
+
+static void put16(ostream &os, uint16_t v) { os.put(char(v & 0xff)).put(char(v >> 8)); }
+static void put32(ostream &os, uint32_t v) { put16(os, uint16_t(v & 0xffff)); put16(os, uint16_t(v >> 16)); }
+
+// 16 bit PCM WAV; the right channel is phase shifted so a downmix is not a plain copy
+static void writeWav(const fs::path &path, const Signal &sig, unsigned rate, unsigned channels, double seconds)
+{
+    size_t frames = size_t(seconds * rate);
+    uint32_t dataBytes = uint32_t(frames * channels * 2);
+    ofstream os(path, ios::binary);
+    os.write("RIFF", 4);
+    put32(os, 36 + dataBytes);
+    os.write("WAVEfmt ", 8);
+    put32(os, 16);
+    put16(os, 1);
+    put16(os, uint16_t(channels));
+    put32(os, rate);
+    put32(os, rate * channels * 2);
+    put16(os, uint16_t(channels * 2));
+    put16(os, 16);
+    os.write("data", 4);
+    put32(os, dataBytes);
+
+    double beat = sig.bpm > 0 ? 60.0 / sig.bpm : 0;
+    for (size_t i = 0; i < frames; ++i) {
+        double t = double(i) / rate;
+        for (unsigned c = 0; c < channels; ++c) {
+            double v = 0;
+            for (double f : sig.tones) {
+                v += sin(2 * M_PI * f * t + c * 0.7) * 0.25 / sig.tones.size();
+            }
+            if (beat > 0) {
+                // 30 ms decaying noise-like burst on every beat
+                double since = fmod(t, beat);
+                if (since < 0.03) {
+                    v += 0.6 * exp(-since * 150) * sin(2 * M_PI * 1800 * since) * sin(2 * M_PI * 3100 * since + 1);
+                }
+            }
+            put16(os, uint16_t(int16_t(lrint(max(-1.0, min(1.0, v)) * 32767))));
+        }
+    }
+    if (!os) {
+        throw runtime_error("cannot write " + path.string());
+    }
+}
+
+static bool have(const string &tool)
+{
+    return system(("command -v " + tool + " >/dev/null 2>&1").c_str()) == 0;
+}
+
+static void encode(const fs::path &wav, const string &ext)
+{
+    fs::path out = wav;
+    out.replace_extension(ext);
+    if (fs::exists(out)) {
+        return;
+    }
+    string in = "'" + wav.string() + "'", dst = "'" + out.string() + "'";
+    string cmd;
+    if (have("ffmpeg")) {
+        cmd = "ffmpeg -loglevel error -y -i " + in + (ext == ".mp3" ? " -c:a libmp3lame -b:a 192k " : " ") + dst;
+    } else if (ext == ".flac" && have("flac")) {
+        cmd = "flac -s -f -o " + dst + " " + in;
+    } else if (ext == ".mp3" && have("lame")) {
+        cmd = "lame --quiet -b 192 " + in + " " + dst;
+    } else {
+        return;
+    }
+    // an encoder may refuse a layout (lame: no 96 kHz), the file is just left out
+    if (system(cmd.c_str()) != 0) {
+        fs::remove(out);
+    }
+}
+
+static map<string, vector<fs::path>> makeCorpus(const fs::path &dir, double seconds)
+{
+    fs::create_directories(dir);
+    map<string, vector<fs::path>> corpus;
+    for (auto &sig : signals) {
+        for (auto &l : layouts) {
+            fs::path wav = dir / (string(sig.name) + "-" + to_string(l.rate) + "-" + to_string(l.channels) + "ch.wav");
+            if (!fs::exists(wav)) {
+                writeWav(wav, sig, l.rate, l.channels, seconds);
+            }
+            encode(wav, ".flac");
+            encode(wav, ".mp3");
+            for (const char *ext : {".wav", ".flac", ".mp3"}) {
+                fs::path p = wav;
+                p.replace_extension(ext);
+                if (fs::exists(p)) {
+                    corpus[ext + 1].push_back(p);
+                }
+            }
+        }
+    }
+    return corpus;
+}
+
+struct Timings {
+    size_t files{0}, errors{0};
+    double audioSeconds{0};
+    chrono::nanoseconds io{0}, key{0}, tempo{0}, total{0};
+    DecodeStats decode;
+};
+
+// seconds of audio decoded, whether the analyzers found something in it or not
+struct LengthSink : AudioSink {
+    unsigned rate{0};
+    size_t samples{0};
+    void begin(const AudioInfo &info) override { rate = info.analysisRate; }
+    void write(const float *, size_t count) override { samples += count; }
+    void end() override {}
+    double seconds() const { return rate ? double(samples) / rate : 0.0; }
+};
+
+static Timings run(const vector<fs::path> &files)
+{
+    Timings t;
+    DecodeOptions options;
+    options.stats = &t.decode;
+    for (auto &path : files) {
+        auto start = Clock::now();
+        auto input = loadFile(path.string(), false);
+        t.io += Clock::now() - start;
+        KeyDetector keyDetector;
+        TempoDetector tempoDetector;
+        TimedSink key(keyDetector, t.key), tempo(tempoDetector, t.tempo);
+        // first: ends before an analyzer's end() throws
+        LengthSink length;
+        SinkFanout sink{&length, &key, &tempo};
+        try {
+            decodeAudio(*input, sink, options);
+        } catch (exception &) {
+            // no beats in a sine: timings and audio still count
+            ++t.errors;
+        }
+        t.audioSeconds += length.seconds();
+        ++t.files;
+        t.total += Clock::now() - start;
+    }
+    return t;
+}
+
+static double seconds(chrono::nanoseconds ns) { return chrono::duration<double>(ns).count(); }
+
+// throughput figures, all "higher is better": stages as multiples of real time
+static map<string, double> figures(const string &format, const Timings &t)
+{
+    auto x = [&](chrono::nanoseconds ns) { return ns.count() ? t.audioSeconds / seconds(ns) : 0.0; };
+    return {
+        {format + ".files_per_s", t.files / seconds(t.total)},
+        {format + ".audio_s_per_s", x(t.total)},
+        {format + ".io_x", x(t.io)},
+        {format + ".demux_x", x(t.decode.demux)},
+        {format + ".decode_x", x(t.decode.decode)},
+        {format + ".convert_x", x(t.decode.convert)},
+        {format + ".key_x", x(t.key)},
+        {format + ".tempo_x", x(t.tempo)},
+    };
+}
+
+static map<string, double> readBaseline(const string &path)
+{
+    ifstream is(path);
+    if (!is) {
+        throw runtime_error("cannot read baseline " + path);
+    }
+    stringstream ss;
+    ss << is.rdbuf();
+    string text = ss.str();
+    map<string, double> values;
+    regex entry("\"([^\"]+)\"\\s*:\\s*([-+0-9.eE]+)");
+    for (sregex_iterator it(text.begin(), text.end(), entry), end; it != end; ++it) {
+        values[(*it)[1]] = stod((*it)[2]);
+    }
+    return values;
+}
+
+static void writeBaseline(const string &path, const map<string, double> &values)
+{
+    ofstream os(path);
+    os << "{\n";
+    size_t i = 0;
+    for (auto &v : values) {
+        os << "  \"" << v.first << "\": " << setprecision(6) << v.second << (++i < values.size() ? ",\n" : "\n");
+    }
+    os << "}\n";
+    if (!os) {
+        throw runtime_error("cannot write " + path);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    string corpusDir = "bench-corpus", save, baseline;
+    double length = 30, tolerance = 10;
+    int repeat = 3;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string arg = argv[i], value = argv[i + 1];
+        if (arg == "--corpus") corpusDir = value;
+        else if (arg == "--seconds") length = stod(value);
+        else if (arg == "--repeat") repeat = max(1, stoi(value));
+        else if (arg == "--save") save = value;
+        else if (arg == "--baseline") baseline = value;
+        else if (arg == "--tolerance") tolerance = stod(value);
+        else {
+            cerr << "unknown option " << arg << "\n";
+            return 2;
+        }
+    }
+    try {
+        auto corpus = makeCorpus(corpusDir, length);
+        map<string, double> current;
+        cout << "format files errors   audio s" << "      io   demux  decode convert     key   tempo"
+             << "   files/s  audio s/s   (stages: x real time, best of " << repeat << ")\n";
+        for (auto &group : corpus) {
+            // the fastest repeat is the least disturbed one
+            Timings best;
+            for (int r = 0; r < repeat; ++r) {
+                Timings t = run(group.second);
+                if (r == 0 || t.total < best.total) {
+                    best = t;
+                }
+            }
+            auto f = figures(group.first, best);
+            current.insert(f.begin(), f.end());
+            const string &g = group.first;
+            cout << left << setw(7) << g << right << setw(5) << best.files << setw(7) << best.errors
+                 << fixed << setprecision(0) << setw(10) << best.audioSeconds;
+            for (const char *stage : {"io_x", "demux_x", "decode_x", "convert_x", "key_x", "tempo_x"}) {
+                cout << setw(8) << f[g + "." + stage];
+            }
+            cout << setprecision(2) << setw(10) << f[g + ".files_per_s"] << setprecision(1) << setw(11)
+                 << f[g + ".audio_s_per_s"] << "\n";
+        }
+        if (!save.empty()) {
+            writeBaseline(save, current);
+        }
+        int regressions = 0;
+        if (!baseline.empty()) {
+            for (auto &b : readBaseline(baseline)) {
+                auto it = current.find(b.first);
+                if (it == current.end() || b.second <= 0) {
+                    continue;   // format not available on this machine
+                }
+                double change = (it->second / b.second - 1) * 100;
+                if (change < -tolerance) {
+                    cout << "REGRESSION " << b.first << ": " << setprecision(2) << it->second << " (baseline "
+                         << b.second << ", " << setprecision(0) << change << "%)\n";
+                    ++regressions;
+                }
+            }
+            cout << (regressions ? "slower than baseline " : "no regression against ") << baseline << "\n";
+        }
+        aubio_cleanup();
+        return regressions ? 1 : 0;
+    } catch (exception &e) {
+        cerr << e.what() << "\n";
+        return 2;
+    }
+}
@@ -1,11 +1,19 @@
+#include <chrono>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 #include <tuple>
 #include <memory>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include "decodeAudio.h"
+#include "sampleConvert.h"
+#include "resampler.h"
 
 extern "C" {
+#include <libavutil/dict.h>
 #include <libavutil/frame.h>
 #include <libavutil/mem.h>
 #include <libavcodec/avcodec.h>
@@ -14,6 +22,46 @@ extern "C" {
 #include <libavutil/samplefmt.h>
 }
 
+/**
+  AVIO buffers of finished files, kept for the next file on the same thread.
+  Probing may swap the buffer for one FFmpeg allocated itself; that one is
+  freed, only buffers from take() are kept
+ *
+ */
+struct IOBufferPool {
+    static const int bufferSize = 4096;
+    std::vector<unsigned char*> buffers;
+
+    ~IOBufferPool() {
+        for (unsigned char *p : buffers) {
+            av_free(p);
+        }
+    }
+    unsigned char *take() {
+        if (buffers.empty()) {
+            auto p = reinterpret_cast<unsigned char*>(av_malloc(bufferSize + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (!p) {
+                throw std::runtime_error("error allocating avio buffer");
+            }
+            return p;
+        }
+        unsigned char *p = buffers.back();
+        buffers.pop_back();
+        return p;
+    }
+    // buffer: the AVIO context's buffer at the end, original: what take() gave it
+    void give(unsigned char *buffer, unsigned char *original) {
+        if (buffer == original && buffers.size() < 4) {
+            buffers.push_back(buffer);
+        } else {
+            av_free(buffer);
+        }
+    }
+    static IOBufferPool & local() {
+        static thread_local IOBufferPool pool;
+        return pool;
+    }
+};
 
 struct MemoryAVFormat {
     MemoryAVFormat(const MemoryAVFormat &) = delete;
@@ -23,10 +71,11 @@ struct MemoryAVFormat {
     std::shared_ptr<AVCodecContext> codec_ctx;
     int audioStreamIndex{0};
 
-    std::vector<char> & compressed_audio;
+    const InputBuffer & compressed_audio;
     size_t audio_offset;
 
-    MemoryAVFormat(std::vector<char> & compressed_audio)
+    // probeOnly - read as little as possible to get the stream parameters, don't open a decoder
+    MemoryAVFormat(const InputBuffer & compressed_audio, bool probeOnly = false)
     :
       io_ctx(nullptr),
       compressed_audio(compressed_audio),
@@ -39,6 +88,12 @@ struct MemoryAVFormat {
             throw std::runtime_error("Failed to allocate context");
         avFormatPtr->pb = io_ctx.get();
         avFormatPtr->flags |= AVFMT_FLAG_CUSTOM_IO;
+        if (probeOnly) {
+            // the defaults (5 MB, 5 s of packets) are for finding every stream of a video,
+            // one audio stream's parameters are in the first frames
+            avFormatPtr->probesize = 64 * 1024;
+            avFormatPtr->max_analyze_duration = AV_TIME_BASE / 2;
+        }
 
         int err = avformat_open_input(&avFormatPtr, "nullptr", nullptr, nullptr);
         if (err != 0 || !avFormatPtr) {
@@ -51,18 +106,23 @@ struct MemoryAVFormat {
                 throw std::runtime_error("Cannot find stream information");
         }
 
-        open_codec_context();
+        find_audio_stream();
+        if (!probeOnly) {
+            open_codec_context();
+        }
     }
 
     bool is_eof() {
         return audio_offset >= compressed_audio.size();
     }
 
+    // theBuf is either the small AVIO buffer (header parsing) or, in direct mode,
+    // the destination packet itself, so payload is copied once: mapping -> packet
     int read (uint8_t* theBuf, int theBufSize) {
-        int aNbRead = std::min (int(compressed_audio.size() - audio_offset), theBufSize);
-        if(aNbRead <= 0) {
+        if (audio_offset >= compressed_audio.size()) {
             return AVERROR_EOF;
         }
+        int aNbRead = int(std::min(compressed_audio.size() - audio_offset, size_t(theBufSize)));
 
         memcpy(theBuf, compressed_audio.data() + audio_offset, aNbRead);
         audio_offset += aNbRead;
@@ -70,15 +130,19 @@ struct MemoryAVFormat {
     }
 
     int64_t seek(int64_t offset, int whence) {
+         whence &= ~AVSEEK_FORCE;
          if (whence == AVSEEK_SIZE) { return compressed_audio.size(); }
-         audio_offset = offset;
 
          if(compressed_audio.data() == nullptr || compressed_audio.size() == 0) { return -1; }
-         if     (whence == SEEK_SET) { audio_offset = offset; }
-         else if(whence == SEEK_CUR) { audio_offset += offset; }
-         else if(whence == SEEK_END) { audio_offset = compressed_audio.size() + offset; }
-
-         return offset;
+         int64_t pos;
+         if     (whence == SEEK_SET) { pos = offset; }
+         else if(whence == SEEK_CUR) { pos = int64_t(audio_offset) + offset; }
+         else if(whence == SEEK_END) { pos = int64_t(compressed_audio.size()) + offset; }
+         else { return -1; }
+         if (pos < 0) { return -1; }
+         audio_offset = size_t(pos);
+
+         return pos;
     }
 
     ~MemoryAVFormat() {
@@ -90,10 +154,9 @@ struct MemoryAVFormat {
     }
 protected:
     void create_audio_buffer_io_context() {
-        const int aBufferSize = 4096;
-        unsigned char* aBufferIO = reinterpret_cast<unsigned char*>(av_malloc(aBufferSize + AV_INPUT_BUFFER_PADDING_SIZE));
+        unsigned char* aBufferIO = IOBufferPool::local().take();
         auto p_io_ctx = avio_alloc_context(aBufferIO,
-                                           aBufferSize,
+                                           IOBufferPool::bufferSize,
                                            0,
                                            this,
                                            [](void* opaque, uint8_t* buf, int bufSize)
@@ -101,65 +164,198 @@ protected:
                                            nullptr,
                                            [](void* opaque, int64_t offset, int whence)
                                            { return (reinterpret_cast<MemoryAVFormat*>(opaque))->seek(offset, whence); });
+        if (!p_io_ctx) {
+            av_free(aBufferIO);
+        }
         io_ctx.reset(p_io_ctx,
-                                                [](AVIOContext* io_ctx) {if (io_ctx) {av_freep(&(io_ctx->buffer)); avio_context_free(&io_ctx);}});
+                     [aBufferIO](AVIOContext* io_ctx) {
+                         if (io_ctx) {
+                             IOBufferPool::local().give(io_ctx->buffer, aBufferIO);
+                             io_ctx->buffer = nullptr;
+                             avio_context_free(&io_ctx);
+                         }
+                     });
         if (!io_ctx) {
             throw std::runtime_error("error allocating avio context");
         }
+        // input is already in memory: let avio_read() hand packet-sized reads
+        // straight to read() instead of staging them in aBufferIO
+        io_ctx->direct = 1;
     }
-    void open_codec_context()
+    void find_audio_stream()
     {
-
         int ret = av_find_best_stream(fmt_ctx.get(), AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
         if (ret < 0) {
             throw std::runtime_error("Could not find audio stream in input file");
-        } else {
-            audioStreamIndex = ret;
-            AVStream *st = fmt_ctx->streams[audioStreamIndex];
+        }
+        audioStreamIndex = ret;
+    }
+    void open_codec_context()
+    {
+        int ret;
+        AVStream *st = fmt_ctx->streams[audioStreamIndex];
 
-            // find decoder for the stream
-            const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
-            if (!codec) {
-                throw(std::runtime_error("Failed to find %s codec\n"));
-            }
+        // find decoder for the stream
+        const AVCodec *codec = avcodec_find_decoder(st->codecpar->codec_id);
+        if (!codec) {
+            throw(std::runtime_error("Failed to find %s codec\n"));
+        }
 
-            /* Allocate a codec context for the decoder */
-            codec_ctx.reset(avcodec_alloc_context3(codec), [](AVCodecContext* p) {avcodec_free_context(&p);});
-            if (!codec_ctx) {
-                throw(std::runtime_error("Failed to allocate the %s codec context\n"));
-            }
+        /* Allocate a codec context for the decoder */
+        codec_ctx.reset(avcodec_alloc_context3(codec), [](AVCodecContext* p) {avcodec_free_context(&p);});
+        if (!codec_ctx) {
+            throw(std::runtime_error("Failed to allocate the %s codec context\n"));
+        }
 
-            // Copy codec parameters from input stream to output codec context
-            if ((ret = avcodec_parameters_to_context(codec_ctx.get(), st->codecpar)) < 0) {
-                throw std::runtime_error("Failed to copy codec parameters to decoder context");
-            }
+        // Copy codec parameters from input stream to output codec context
+        if ((ret = avcodec_parameters_to_context(codec_ctx.get(), st->codecpar)) < 0) {
+            throw std::runtime_error("Failed to copy codec parameters to decoder context");
+        }
 
-            // Init the decoders
-            if ((ret = avcodec_open2(codec_ctx.get(), codec, nullptr)) < 0) {
-                throw std::runtime_error("Failed to open audio codec");
-            }
+        // Init the decoders
+        if ((ret = avcodec_open2(codec_ctx.get(), codec, nullptr)) < 0) {
+            throw std::runtime_error("Failed to open audio codec");
+        }
+    }
+
+};
+
+/**
+  Per-thread decoding objects reused from file to file.
+  The codec context itself is not reused: FFmpeg binds stream parameters
+  (extradata, sample format, channel layout) to it in avcodec_open2
+ *
+ */
+struct DecodeContext {
+    std::shared_ptr<AVPacket> packet{av_packet_alloc(), [](AVPacket* p) {av_packet_free(&p);}};
+    std::shared_ptr<AVFrame> frame{av_frame_alloc(), [](AVFrame* p){av_frame_free(&p);}};
+    // keeps its filter table while files come in at the same rate
+    Resampler resampler;
+    // frames with all their channels, for sinks that want them
+    std::vector<float> frames;
+
+    static DecodeContext & local() {
+        static thread_local DecodeContext ctx;
+        if (!ctx.packet || !ctx.frame) {
+            throw std::runtime_error("Failed to allocate packet or frame");
         }
+        return ctx;
+    }
+};
+
+static SampleType sampleTypeOf(AVSampleFormat fmt)
+{
+    switch (av_get_packed_sample_fmt(fmt)) {
+    case AV_SAMPLE_FMT_U8:  return SampleType::U8;
+    case AV_SAMPLE_FMT_S16: return SampleType::S16;
+    case AV_SAMPLE_FMT_S32: return SampleType::S32;
+    case AV_SAMPLE_FMT_S64: return SampleType::S64;
+    case AV_SAMPLE_FMT_FLT: return SampleType::FLT;
+    case AV_SAMPLE_FMT_DBL: return SampleType::DBL;
+    default: throw std::runtime_error("Sample format not supported");
     }
+}
 
+/**
+  Conversion kernel for the frames of one stream, chosen when the first
+  frame arrives instead of per sample; chosen again only if a decoder
+  changes format or channel count mid-stream
+ *
+ */
+struct FrameConverter {
+    int format{AV_SAMPLE_FMT_NONE};
+    int channels{0};
+    ChannelMode mode;
+    ConvertFn fn{nullptr};
+    // set: every frame is also converted here with all its channels
+    std::vector<float> *frames{nullptr};
+    ConvertFn allFn{nullptr};
+
+    explicit FrameConverter(ChannelMode mode) : mode(mode) {}
+
+    void operator()(const AVFrame *frame, float *out) {
+        if (frame->format != format || frame->channels != channels) {
+            AVSampleFormat fmt = AVSampleFormat(frame->format);
+            SampleType type = sampleTypeOf(fmt);
+            bool planar = av_sample_fmt_is_planar(fmt);
+            fn = selectConverter(type, planar, unsigned(frame->channels), mode);
+            allFn = selectConverter(type, planar, unsigned(frame->channels), ChannelMode::All);
+            format = frame->format;
+            channels = frame->channels;
+        }
+        size_t n = size_t(frame->nb_samples);
+        fn(frame->extended_data, unsigned(channels), n, out);
+        if (frames) {
+            // keeps its capacity from file to file
+            frames->resize(n * unsigned(channels));
+            allFn(frame->extended_data, unsigned(channels), n, frames->data());
+        }
+    }
+};
+
+// adds the time until it goes out of scope to *total, does nothing without one
+class StatsTimer {
+    std::chrono::nanoseconds *total;
+    std::chrono::steady_clock::time_point start;
+public:
+    explicit StatsTimer(std::chrono::nanoseconds *total) : total(total) {
+        if (total) start = std::chrono::steady_clock::now();
+    }
+    ~StatsTimer() {
+        if (total) *total += std::chrono::steady_clock::now() - start;
+    }
+};
+
+/**
+  Part of the stream passed to the sink, in stream time base;
+  frames are taken whole, so the edges are off by up to one frame
+ *
+ */
+struct DecodeWindow {
+    int64_t begin{INT64_MIN};
+    int64_t end{INT64_MAX};
+    AVRational timeBase{1, 1};
+    // a frame at or past the end was decoded: stop reading packets
+    bool done{false};
+
+    bool take(const AVFrame *frame) {
+        int64_t ts = frame->best_effort_timestamp;
+        if (ts == AV_NOPTS_VALUE || frame->sample_rate <= 0) {
+            return !done;
+        }
+        if (ts >= end) {
+            done = true;
+            return false;
+        }
+        return ts + av_rescale_q(frame->nb_samples, AVRational{1, frame->sample_rate}, timeBase) > begin;
+    }
 };
 
 /**
-  Decode compressed audio packet to float 32 bit pcm data
-  and append result data to resultBuf
-  if source file was mono, second channel is artificially added
+  Decode compressed audio packet to float 32 bit pcm data,
+  downmix every decoded frame inside window into the resampler and pass its output to sink
  *
  */
-void decodePacket(AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame, std::vector<float> &resultBuf, bool isLast = true)
+void decodePacket(AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame, FrameConverter &convert,
+                  Resampler &resampler, AudioSink &sink, DecodeWindow &window, DecodeStats *stats,
+                  bool isLast = true)
 {
     // send the packet with the compressed data to the decoder
-    int ret = avcodec_send_packet(ctx, pkt);
+    int ret;
+    {
+        StatsTimer t(stats ? &stats->decode : nullptr);
+        ret = avcodec_send_packet(ctx, pkt);
+    }
     if (ret < 0) {
         return;  // skip bad packets but continue
     }
 
     // read all the output frames (in general there may be any number of them)
     while (ret >= 0) {
-        ret = avcodec_receive_frame(ctx, frame);
+        {
+            StatsTimer t(stats ? &stats->decode : nullptr);
+            ret = avcodec_receive_frame(ctx, frame);
+        }
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
             return;
         else if (ret < 0) {
@@ -168,116 +364,214 @@ void decodePacket(AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame, std::vecto
             }
 	    throw std::runtime_error("Error during decoding\n");
         }
-        size_t sampleSize = av_get_bytes_per_sample(ctx->sample_fmt);
-        bool planar{!!av_sample_fmt_is_planar(ctx->sample_fmt)};
-
-        if (planar) {
-            size_t len = resultBuf.size();
-            resultBuf.resize(len + frame->nb_samples);
-            for (size_t i = 0; i < frame->nb_samples; i++) {
-                // store only first channel if stereo:                
-                switch (ctx->sample_fmt) {
-                case AV_SAMPLE_FMT_S16P: {
-                    *(resultBuf.data()+len+i) = float(*(reinterpret_cast<int16_t*>(frame->data[0]) + i));
-                    break;
-                }
-                case AV_SAMPLE_FMT_S32P: {
-                    const float recip = 1.0 / (32768.0*65536.0);
-                    *(resultBuf.data()+len + i) = float(*(reinterpret_cast<int32_t*>(frame->data[0]) + i)) * recip;
-                    break;
-                }
-                case AV_SAMPLE_FMT_FLTP: { // float 32 bit samples
-                    *(resultBuf.data()+len + i) = *(reinterpret_cast<float*>(frame->data[0]) + i);
-                    break;
-                }
-                default: throw std::runtime_error("Sample format not supported");
-                }
-            }
-        }else {  // interleaved
-            size_t len = resultBuf.size();
-            resultBuf.resize(len + frame->nb_samples);
-            if (frame->channels == 1) {
-                switch (ctx->sample_fmt) {
-                case AV_SAMPLE_FMT_S16: {
-                    for (int i = 0; i < frame->nb_samples; i++) {
-                        *(resultBuf.data()+len + i) = float(*(reinterpret_cast<int16_t*>(frame->data[0]) + i*ctx->channels));
-                    }
-                    break;
-                    }
-                case AV_SAMPLE_FMT_S32: {
-                    const float recip = 1.0 / (32768.0*65536.0);
-                    for (int i = 0; i < frame->nb_samples; i++) {
-                        *(resultBuf.data()+len + i) = float(*(reinterpret_cast<int32_t*>(frame->data[0]) + i)) * recip;
-                    }
-                    break;
-                }
-                case AV_SAMPLE_FMT_FLT: { // float 32 bit samples
-                    memcpy(resultBuf.data() + len, frame->data[0], frame->nb_samples * frame->channels * sampleSize);
-                    break;
-                }
-                default: throw std::runtime_error("Sample format not supported");
-                }
-            }else {
-                // store only first channel if stereo:
-                for (int i = 0; i < frame->nb_samples; i++) {
-                    switch (ctx->sample_fmt) {
-                    case AV_SAMPLE_FMT_S16: {
-                        *(resultBuf.data()+len + i) = float(*(reinterpret_cast<int16_t*>(frame->data[0]) + i));
-                        break;
-                        }
-                    case AV_SAMPLE_FMT_S32: {
-                        const float recip = 1.0 / (32768.0*65536.0);
-                        *(resultBuf.data()+len + i) = float(*(reinterpret_cast<int32_t*>(frame->data[0]) + i)) * recip;
-                        break;
-                    }
-                    case AV_SAMPLE_FMT_FLT: { // float 32 bit samples
-                        *(resultBuf.data()+len + i) = *(reinterpret_cast<float*>(frame->data[0]) + i);
-                        break;
-                    }
-                    default: throw std::runtime_error("Sample format not supported");
-                    }
-                }
-            }
+        if (!window.take(frame)) {
+            av_frame_unref(frame);
+            continue;
+        }
+        // some decoders only know the real rate once they decode (e.g. AAC with SBR)
+        if (frame->sample_rate > 0 && unsigned(frame->sample_rate) != resampler.inputRate()) {
+            resampler.reset(unsigned(frame->sample_rate), resampler.outputRate());
+        }
+        // the resampler's buffer keeps its capacity: no allocation after the first frames
+        size_t n = size_t(frame->nb_samples);
+        std::pair<const float *, size_t> out;
+        {
+            StatsTimer t(stats ? &stats->convert : nullptr);
+            convert(frame, resampler.input(n));
+            av_frame_unref(frame);
+            out = resampler.process(n);
+        }
+        if (convert.frames) {
+            sink.writeFrames(convert.frames->data(), n, unsigned(convert.channels), resampler.inputRate());
+        }
+        if (out.second > 0) {
+            sink.write(out.first, out.second);
         }
-        av_frame_unref(frame);
     }
 }
 
+// decode packets of the audio stream until the window is complete or the input ends
+static void decodeWindow(MemoryAVFormat &av, DecodeContext &dc, FrameConverter &convert,
+                         AudioSink &sink, DecodeWindow &window, DecodeStats *stats)
+{
+    AVPacket *packet = dc.packet.get();
+    AVFrame *decoded_frame = dc.frame.get();
+    auto readFrame = [&] {
+        StatsTimer t(stats ? &stats->demux : nullptr);
+        return av_read_frame(av.fmt_ctx.get(), packet);
+    };
+    while (!window.done && readFrame() >= 0) {
+            // check if the packet belongs to a stream we are interested in, otherwise
+            // skip it
+            if (packet->stream_index == av.audioStreamIndex) {
+                try {
+                    decodePacket(av.codec_ctx.get(), packet, decoded_frame, convert, dc.resampler, sink, window, stats,
+                                 av.is_eof());
+                } catch (...) {
+                    // the packet and frame outlive this file: leave them empty
+                    av_packet_unref(packet);
+                    av_frame_unref(decoded_frame);
+                    throw;
+                }
+            }
+            av_packet_unref(packet);
+        }
+}
 
 /**
-  Decode compressed audio (mp3, wma, flac, etc) to float 32 bit pcm data
-  compressedBuf - compressed file data (already read to memory)
-  return value - vector of float 32 bit pcm samples, interleaved stereo
-  if source file was stereo, only first channel is returned
+  Window of one piece of a split file (options.rangeEnd > 0), or
+  windows of segment mode: options.segments pieces spread evenly over the track,
+  centred at 1/(n+1), 2/(n+1)... of its length so intro and outro are left out.
+  Empty if the whole track should be decoded (mode off, unknown length,
+  or a track not much longer than the segments together)
  *
  */
-std::tuple<std::vector<float>, int64_t, unsigned, unsigned, unsigned> decodeAudio(std::vector<char> &compressedBuf)
+static std::vector<DecodeWindow> segmentWindows(const MemoryAVFormat &av, const DecodeOptions &options)
+{
+    std::vector<DecodeWindow> windows;
+    const AVStream *st = av.fmt_ctx->streams[av.audioStreamIndex];
+    int64_t duration = av.fmt_ctx->duration;  // AV_TIME_BASE units
+    int64_t start = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    if (options.rangeEnd > 0) {
+        DecodeWindow w;
+        w.timeBase = st->time_base;
+        w.begin = start + av_rescale_q(options.rangeBegin, AV_TIME_BASE_Q, st->time_base);
+        // durations are estimates (VBR without a Xing header): the last piece decodes to EOF
+        if (options.rangeEnd != DecodeOptions::toEnd) {
+            w.end = start + av_rescale_q(options.rangeEnd, AV_TIME_BASE_Q, st->time_base);
+        }
+        windows.push_back(w);
+        return windows;
+    }
+    int64_t length = int64_t(options.segmentSeconds * AV_TIME_BASE);
+    if (options.segments == 0 || length <= 0 || duration == AV_NOPTS_VALUE ||
+        duration < 2 * length * int64_t(options.segments)) {
+        return windows;
+    }
+    for (unsigned i = 0; i < options.segments; ++i) {
+        int64_t centre = duration / (options.segments + 1) * (i + 1);
+        DecodeWindow w;
+        w.timeBase = st->time_base;
+        w.begin = start + av_rescale_q(centre - length / 2, AV_TIME_BASE_Q, st->time_base);
+        w.end = start + av_rescale_q(centre + length / 2, AV_TIME_BASE_Q, st->time_base);
+        windows.push_back(w);
+    }
+    return windows;
+}
+
+
+AudioInfo decodeAudio(const InputBuffer &compressedBuf, AudioSink &sink, const DecodeOptions &options)
 {
-    std::vector<float> resultWav;
     if (compressedBuf.size() == 0) {
-        return {std::move(resultWav), 0, 0, 0, 0};
+        AudioInfo info{0, 0, 0, 0, 0};
+        sink.begin(info);
+        sink.end();
+        return info;
     }
+    DecodeStats *stats = options.stats;
+    auto openStart = std::chrono::steady_clock::now();
     MemoryAVFormat av(compressedBuf);
+    if (stats) {
+        stats->demux += std::chrono::steady_clock::now() - openStart;
+    }
+
+    AudioInfo info;
+    info.channels = av.codec_ctx->channels; // // c->ch_layout.nb_channels
+    info.sampleRate = av.codec_ctx->sample_rate;
+    info.bitRate = av.codec_ctx->bit_rate;
+    info.duration = av.fmt_ctx->duration;
+    info.analysisRate = options.analysisRate ? options.analysisRate : info.sampleRate;
+
     // decode audio data:
-    std::shared_ptr<AVPacket> packet(av_packet_alloc(), [](AVPacket* p) {av_packet_free(&p);});
-    std::shared_ptr<AVFrame> decoded_frame(av_frame_alloc(), [](AVFrame* p){av_frame_free(&p);});
-    // read frames from the file
-    while (int ret=av_read_frame(av.fmt_ctx.get(), packet.get()) >= 0) {
-            // check if the packet belongs to a stream we are interested in, otherwise
-            // skip it
-            if (packet->stream_index == av.audioStreamIndex) {
-                decodePacket(av.codec_ctx.get(), packet.get(), decoded_frame.get(), resultWav, av.is_eof());
-            }
-            av_packet_unref(packet.get());
+    DecodeContext &dc = DecodeContext::local();
+    Resampler &resampler = dc.resampler;
+    resampler.reset(info.sampleRate, info.analysisRate);
+    FrameConverter convert(options.channels);
+    if (sink.wantsFrames()) {
+        convert.frames = &dc.frames;
+    }
+    sink.begin(info);
+
+    DecodeWindow whole;
+    auto windows = segmentWindows(av, options);
+    for (auto &w : windows) {
+        // the packets in between are never read; the segments are analyzed back to back
+        int ret;
+        {
+            StatsTimer t(stats ? &stats->demux : nullptr);
+            ret = av_seek_frame(av.fmt_ctx.get(), av.audioStreamIndex, w.begin, AVSEEK_FLAG_BACKWARD);
+        }
+        // not seekable (a stream without an index, a damaged one): read on from
+        // where the last window ended, the frames before this one are dropped
+        if (ret >= 0) {
+            avcodec_flush_buffers(av.codec_ctx.get());
         }
+        decodeWindow(av, dc, convert, sink, w, stats);
+    }
+    if (windows.empty()) {
+        decodeWindow(av, dc, convert, sink, whole, stats);
+    }
 
         // flush the decoders
-        decodePacket(av.codec_ctx.get(), nullptr, decoded_frame.get(), resultWav);
+        decodePacket(av.codec_ctx.get(), nullptr, dc.frame.get(), convert, resampler, sink,
+                     windows.empty() ? whole : windows.back(), stats);
+    std::pair<const float *, size_t> tail;
+    {
+        StatsTimer t(stats ? &stats->convert : nullptr);
+        tail = resampler.flush();
+    }
+    if (tail.second > 0) {
+        sink.write(tail.first, tail.second);
+    }
+    sink.end();
+
+    return info;
+}
 
-    int n_channels = av.codec_ctx->channels; // // c->ch_layout.nb_channels
-    int sample_rate = av.codec_ctx->sample_rate;
-    int bit_rate = av.codec_ctx->bit_rate;
-    int64_t duration = av.fmt_ctx->duration;
+std::string resultSettings(const DecodeOptions &options)
+{
+    static const char *modes[] = {"first", "mix", "all"};
+    std::string s = std::to_string(options.analysisRate) + " " + modes[int(options.channels)];
+    if (options.segments > 0) {
+        char seconds[32];
+        snprintf(seconds, sizeof seconds, "%g", options.segmentSeconds);
+        s += " " + std::to_string(options.segments) + "x" + seconds;
+    }
+    return s;
+}
 
-    return {std::move(resultWav), duration, sample_rate, n_channels, bit_rate};
+// first non-empty value of any of names, in the container's or the audio stream's metadata
+static std::string findTag(const MemoryAVFormat &av, std::initializer_list<const char *> names)
+{
+    const AVDictionary *dicts[] = {av.fmt_ctx->metadata, av.fmt_ctx->streams[av.audioStreamIndex]->metadata};
+    for (const AVDictionary *d : dicts) {
+        for (const char *name : names) {
+            // keys are matched case-insensitively
+            AVDictionaryEntry *e = av_dict_get(d, name, nullptr, 0);
+            if (e && e->value && *e->value) {
+                return e->value;
+            }
+        }
+    }
+    return {};
+}
+
+AudioInfo probeAudio(const InputBuffer &compressedBuf, AudioTags &tags)
+{
+    if (compressedBuf.size() == 0) {
+        throw std::runtime_error("empty file");
+    }
+    MemoryAVFormat av(compressedBuf, true);
+    const AVCodecParameters *par = av.fmt_ctx->streams[av.audioStreamIndex]->codecpar;
+
+    AudioInfo info;
+    info.channels = par->channels;
+    info.sampleRate = par->sample_rate;
+    info.analysisRate = 0;
+    info.bitRate = par->bit_rate ? par->bit_rate : av.fmt_ctx->bit_rate;
+    info.duration = av.fmt_ctx->duration;
+    // ID3v2 frames keep their names, Vorbis comments and APE tags use words; MP4 "tmpo"
+    tags.key = findTag(av, {"TKEY", "INITIALKEY", "KEY"});
+    tags.tempo = findTag(av, {"TBPM", "BPM", "tmpo"});
+    return info;
 }
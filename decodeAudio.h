@@ -0,0 +1,112 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "inputBuffer.h"
+#include "sampleConvert.h"
+
+struct AudioInfo
+{
+    int64_t duration;       // microseconds (AV_TIME_BASE units)
+    unsigned sampleRate;    // of the file
+    unsigned analysisRate;  // of the samples passed to AudioSink::write()
+    unsigned channels;
+    unsigned bitRate;
+};
+
+/**
+  Consumer of decoded audio.
+  decodeAudio() calls begin() once the stream parameters are known,
+  then write() for every decoded frame and end() after the decoder is flushed.
+ *
+ */
+class AudioSink
+{
+public:
+    virtual ~AudioSink() = default;
+    virtual void begin(const AudioInfo &info) = 0;
+    // mono float 32 bit samples, the pointer is only valid during the call
+    virtual void write(const float *samples, size_t count) = 0;
+    virtual void end() = 0;
+
+    // sinks that measure the file as it is (loudness, peaks) also get every
+    // decoded frame before downmix and resampling: all channels interleaved,
+    // at the rate of the frame. Costs one more conversion, so only if asked for
+    virtual bool wantsFrames() const { return false; }
+    virtual void writeFrames(const float *samples, size_t frames, unsigned channels, unsigned rate) {}
+};
+
+// time spent in each step of decodeAudio(), summed over calls
+struct DecodeStats
+{
+    std::chrono::nanoseconds demux{0};      // opening the container and reading packets
+    std::chrono::nanoseconds decode{0};
+    std::chrono::nanoseconds convert{0};    // downmix and resampling
+};
+
+// what the sinks get from decodeAudio()
+struct DecodeOptions
+{
+    // sample rate the audio is converted to, 0 = keep the file's rate
+    unsigned analysisRate{22050};
+    // how channels are reduced to mono
+    ChannelMode channels{ChannelMode::Mix};
+    // segment mode: analyze only this many pieces of the track, 0 = whole track
+    unsigned segments{0};
+    double segmentSeconds{30};
+    // decode only [rangeBegin, rangeEnd) of the track, in microseconds; 0 = whole track,
+    // toEnd = from rangeBegin to the end of the stream, however long it really is.
+    // Used for the pieces of a split file
+    static constexpr int64_t toEnd = INT64_MAX;
+    int64_t rangeBegin{0};
+    int64_t rangeEnd{0};
+    // Worker: files longer than this are analyzed in pieces on several threads, 0 = never
+    unsigned splitMinutes{20};
+    // probe mode: take duration and frequency from the headers and key/tempo
+    // from tags, never decode (see probeAudio())
+    bool probeOnly{false};
+    // skip decoding files that have both a key and a tempo tag
+    // (if no analyzer but key and tempo is enabled)
+    bool useTags{false};
+    // analyzers run on the decoded audio (see makeAnalyzer()), in CSV column order
+    std::vector<std::string> analyzers{"key", "tempo"};
+    // if set, decoding steps are timed and added here (benchmarks); not thread safe
+    DecodeStats *stats{nullptr};
+};
+
+/**
+  Decode compressed audio (mp3, wma, flac, etc) frame by frame and pass
+  the pcm data to sink, the whole track is never held in memory.
+  Frames are downmixed straight into the resampler's input, so the sinks
+  see one mono stream at options.analysisRate (and the frames themselves
+  if they want them, see AudioSink::wantsFrames()).
+  In segment mode the demuxer seeks from segment to segment and only
+  those packets are decoded; the sinks get the segments back to back
+ *
+ */
+AudioInfo decodeAudio(const InputBuffer &compressedBuf, AudioSink &sink, const DecodeOptions &options = {});
+
+/**
+  The settings of options the analyzers' results depend on (analysis rate,
+  channel mode, segments) as text, e.g. "22050 mix 3x30": results of other
+  settings are other results (see AnalysisCache)
+ *
+ */
+std::string resultSettings(const DecodeOptions &options);
+
+// key and tempo tags of a file, as the tagger wrote them (TKEY/INITIALKEY, TBPM/BPM)
+struct AudioTags
+{
+    std::string key;
+    std::string tempo;
+};
+
+/**
+  Duration, sample rate and channels from the container headers without
+  decoding anything, and the key and tempo tags if the file has them.
+  Reads only the first 64 KB or so for most formats
+ *
+ */
+AudioInfo probeAudio(const InputBuffer &compressedBuf, AudioTags &tags);
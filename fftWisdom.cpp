@@ -0,0 +1,94 @@
+#include "fftWisdom.h"
+#include "analysis.h"
+#include <cstdio>
+#include <mutex>
+#include <vector>
+#include <fftw3.h>
+
+using namespace std;
+
+// KeyFinder's chromagram frame (FFTFRAMESIZE in keyfinder/constants.h), double precision
+static const int keyFrameSize = 16384;
+// SpectralCentroid's frame up to 64 kHz, single precision
+static const int centroidFrameSize = 2048;
+
+// planned with the buffers the libraries use: fftw_malloc'ed, out of place.
+// flags FFTW_MEASURE | FFTW_WISDOM_ONLY only looks the problem up
+static bool planDouble(int n, unsigned flags)
+{
+    double *in = static_cast<double *>(fftw_malloc(sizeof(double) * n));
+    fftw_complex *out = static_cast<fftw_complex *>(fftw_malloc(sizeof(fftw_complex) * (n / 2 + 1)));
+    fftw_plan forward = fftw_plan_dft_r2c_1d(n, in, out, flags);
+    fftw_plan backward = fftw_plan_dft_c2r_1d(n, out, in, flags);
+    bool found = forward && backward;
+    if (forward) fftw_destroy_plan(forward);
+    if (backward) fftw_destroy_plan(backward);
+    fftw_free(in);
+    fftw_free(out);
+    return found;
+}
+
+// aubio and the centroid in single precision: r2c, or half-complex r2r without complex.h
+static bool planFloat(int n, unsigned flags)
+{
+    float *in = static_cast<float *>(fftwf_malloc(sizeof(float) * n));
+    float *half = static_cast<float *>(fftwf_malloc(sizeof(float) * n));
+    fftwf_complex *out = static_cast<fftwf_complex *>(fftwf_malloc(sizeof(fftwf_complex) * (n / 2 + 1)));
+    fftwf_plan plans[] = {
+        fftwf_plan_dft_r2c_1d(n, in, out, flags),
+        fftwf_plan_dft_c2r_1d(n, out, in, flags),
+        fftwf_plan_r2r_1d(n, in, half, FFTW_R2HC, flags),
+        fftwf_plan_r2r_1d(n, half, in, FFTW_HC2R, flags),
+    };
+    bool found = true;
+    for (fftwf_plan p : plans) {
+        found = found && p;
+        if (p) fftwf_destroy_plan(p);
+    }
+    fftwf_free(in);
+    fftwf_free(half);
+    fftwf_free(out);
+    return found;
+}
+
+bool prepareFftWisdom(const string &path, unsigned analysisRate)
+{
+    fftw_import_wisdom_from_filename(path.c_str());
+    fftwf_import_wisdom_from_filename((path + ".f").c_str());
+    // tempo detection frame of the analysis rate; files at their own rate (0) mostly come at 44.1 kHz
+    uint_t tempoFrame, hop;
+    TempoDetector::frameSizes(analysisRate ? analysisRate : 44100, tempoFrame, hop);
+
+    bool changed = false;
+    for (int n : {keyFrameSize, int(tempoFrame)}) {
+        if (!planDouble(n, FFTW_MEASURE | FFTW_WISDOM_ONLY)) {
+            planDouble(n, FFTW_MEASURE);
+            changed = true;
+        }
+    }
+    bool saved = true;
+    if (changed) {
+        // readers never see a half written file
+        string tmp = path + ".tmp";
+        saved = fftw_export_wisdom_to_filename(tmp.c_str()) && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+    changed = false;
+    for (int n : {int(tempoFrame), centroidFrameSize}) {
+        if (!planFloat(n, FFTW_MEASURE | FFTW_WISDOM_ONLY)) {
+            planFloat(n, FFTW_MEASURE);
+            changed = true;
+        }
+    }
+    if (changed) {
+        string tmp = path + ".f.tmp";
+        saved = fftwf_export_wisdom_to_filename(tmp.c_str()) && rename(tmp.c_str(), (path + ".f").c_str()) == 0 &&
+                saved;
+    }
+    return saved;
+}
+
+void makeFftPlannerThreadSafe()
+{
+    static once_flag once;
+    call_once(once, [] { fftwf_make_planner_thread_safe(); });
+}
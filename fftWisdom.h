@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+
+/**
+  FFTW wisdom for the transforms of key, tempo and centroid detection.
+  KeyFinder, aubio and SpectralCentroid plan their FFTs with
+  FFTW_ESTIMATE, which guesses; FFTW uses wisdom of a more careful planning for such plans when it has
+  it. The first run with a wisdom file measures the transforms of the
+  analysis rate (a few seconds) and saves them, later runs load them
+  in milliseconds. Call before any analysis thread starts.
+  Returns false if the file could not be written (the run goes on)
+ *
+ */
+bool prepareFftWisdom(const std::string &path, unsigned analysisRate);
+
+/**
+  Single precision FFTW planning from several threads at once: aubio
+  plans and destroys its FFTs for every file, SpectralCentroid for every
+  new frame size, each on whatever pool thread runs the file. Call before
+  the analysis threads start; later calls do nothing
+ *
+ */
+void makeFftPlannerThreadSafe();
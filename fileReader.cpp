@@ -0,0 +1,447 @@
+#include "fileReader.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define FILE_READER_URING 1
+#endif
+
+using namespace std;
+
+// big enough for the disk to stream, small enough to spread one file over the queue
+static const size_t chunkSize = size_t(1) << 20;
+// files opened and ordered ahead of the reads
+static const size_t maxWindow = 64;
+
+struct FileReader::Job
+{
+    size_t index;
+    string path;
+    int fd{-1};
+    uint64_t size{0};
+    uint64_t physical{0};
+    vector<char> buf;
+    uint64_t issued{0};     // bytes handed to chunks
+    unsigned pending{0};    // chunks in flight
+    string error;
+    chrono::steady_clock::time_point started;
+};
+
+struct FileReader::Chunk
+{
+    Job *job;
+    uint64_t offset;
+    iovec iov;
+    int64_t result{0};      // bytes read or -errno
+};
+
+class FileReader::Backend
+{
+public:
+    virtual ~Backend() = default;
+    // queue a read of chunk->iov at chunk->offset
+    virtual void read(Chunk *chunk) = 0;
+    // start the queued reads
+    virtual void submit() = 0;
+    // wait for at least one read to finish, append the finished ones
+    virtual void reap(vector<Chunk *> &done) = 0;
+    virtual const char *name() const = 0;
+};
+
+// pread() on a few threads: works everywhere, costs a thread per read in flight
+class ThreadBackend : public FileReader::Backend
+{
+    mutex m;
+    condition_variable work;
+    condition_variable finished;
+    deque<FileReader::Chunk *> queue;
+    vector<FileReader::Chunk *> completed;
+    bool stopping{false};
+    vector<thread> threads;
+public:
+    explicit ThreadBackend(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            threads.emplace_back(&ThreadBackend::run, this);
+        }
+    }
+    ~ThreadBackend() override {
+        {
+            lock_guard<mutex> l{m};
+            stopping = true;
+        }
+        work.notify_all();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+    void read(FileReader::Chunk *chunk) override {
+        {
+            lock_guard<mutex> l{m};
+            queue.push_back(chunk);
+        }
+        work.notify_one();
+    }
+    void submit() override {}
+    void reap(vector<FileReader::Chunk *> &done) override {
+        unique_lock<mutex> l{m};
+        finished.wait(l, [&] { return !completed.empty(); });
+        done.insert(done.end(), completed.begin(), completed.end());
+        completed.clear();
+    }
+    const char *name() const override { return "threads"; }
+private:
+    void run() {
+        for (;;) {
+            FileReader::Chunk *c;
+            {
+                unique_lock<mutex> l{m};
+                work.wait(l, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                c = queue.front();
+                queue.pop_front();
+            }
+            ssize_t r;
+            while ((r = pread(c->job->fd, c->iov.iov_base, c->iov.iov_len, off_t(c->offset))) < 0 && errno == EINTR) {
+            }
+            c->result = r < 0 ? -errno : r;
+            {
+                lock_guard<mutex> l{m};
+                completed.push_back(c);
+            }
+            finished.notify_one();
+        }
+    }
+};
+
+#ifdef FILE_READER_URING
+
+/**
+  io_uring without liburing: one submission and one completion ring shared
+  with the kernel, the reads go in with a single system call per batch and
+  the kernel keeps all of them queued at the device
+ *
+ */
+class UringBackend : public FileReader::Backend
+{
+    int ring{-1};
+    void *sqRing{MAP_FAILED};
+    void *cqRing{MAP_FAILED};
+    size_t sqRingSize{0};
+    size_t cqRingSize{0};
+    io_uring_sqe *sqes{static_cast<io_uring_sqe *>(MAP_FAILED)};
+    size_t sqesSize{0};
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+    unsigned queued{0};     // written to the ring, not submitted yet
+public:
+    // throws std::runtime_error if the kernel doesn't give out a ring
+    explicit UringBackend(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof p);
+        ring = int(syscall(__NR_io_uring_setup, entries, &p));
+        if (ring < 0) {
+            throw runtime_error(string("io_uring_setup: ") + strerror(errno));
+        }
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) {
+            sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                      IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing
+                        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring,
+                               IORING_OFF_CQ_RING);
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            int err = errno;
+            release();
+            throw runtime_error(string("can't map io_uring: ") + strerror(err));
+        }
+        char *sq = static_cast<char *>(sqRing), *cq = static_cast<char *>(cqRing);
+        sqTail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    }
+    ~UringBackend() override { release(); }
+
+    // the caller keeps no more reads in flight than the ring has entries
+    void read(FileReader::Chunk *chunk) override {
+        unsigned tail = *sqTail;    // only written here
+        unsigned i = tail & *sqMask;
+        io_uring_sqe &sqe = sqes[i];
+        memset(&sqe, 0, sizeof sqe);
+        // READV is in every kernel with io_uring (5.1), READ only from 5.6
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = chunk->job->fd;
+        sqe.addr = reinterpret_cast<uint64_t>(&chunk->iov);
+        sqe.len = 1;
+        sqe.off = chunk->offset;
+        sqe.user_data = reinterpret_cast<uint64_t>(chunk);
+        sqArray[i] = i;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++queued;
+    }
+    void submit() override {
+        while (queued > 0) {
+            int n = enter(queued, 0, 0);
+            if (n < 0) {
+                throw runtime_error(string("io_uring_enter: ") + strerror(errno));
+            }
+            queued -= unsigned(n);
+        }
+    }
+    void reap(vector<FileReader::Chunk *> &done) override {
+        for (;;) {
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            if (head != tail) {
+                for (; head != tail; ++head) {
+                    io_uring_cqe &cqe = cqes[head & *cqMask];
+                    auto *c = reinterpret_cast<FileReader::Chunk *>(cqe.user_data);
+                    c->result = cqe.res;
+                    done.push_back(c);
+                }
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                return;
+            }
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                throw runtime_error(string("io_uring_enter: ") + strerror(errno));
+            }
+        }
+    }
+    const char *name() const override { return "io_uring"; }
+private:
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        int n;
+        while ((n = int(syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0))) < 0 &&
+               errno == EINTR) {
+        }
+        return n;
+    }
+    void release() {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ring >= 0) close(ring);
+    }
+};
+
+#endif
+
+// position of the file's first block on its device, 0 if the file system doesn't tell
+static uint64_t firstBlock(int fd)
+{
+    alignas(fiemap) char request[sizeof(fiemap) + sizeof(fiemap_extent)];
+    memset(request, 0, sizeof request);
+    auto *map = reinterpret_cast<fiemap *>(request);
+    map->fm_length = ~uint64_t(0);
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0) {
+        return 0;
+    }
+    return map->fm_extents[0].fe_physical;
+}
+
+FileReader::FileReader(vector<string> paths, size_t depth, size_t maxBytes)
+    : paths(move(paths)), depth(depth ? depth : 1), maxBytes(maxBytes)
+{
+#ifdef FILE_READER_URING
+    try {
+        backend = make_unique<UringBackend>(unsigned(this->depth));
+    } catch (runtime_error &) {
+        // ENOSYS, or EPERM where a seccomp filter blocks it
+    }
+#endif
+    if (!backend) {
+        backend = make_unique<ThreadBackend>(min<size_t>(this->depth, 16));
+    }
+}
+
+FileReader::~FileReader()
+{
+    // the kernel or a thread may still write into the buffers: let the reads end first
+    vector<Chunk *> done;
+    while (inFlight > 0) {
+        done.clear();
+        backend->reap(done);
+        for (Chunk *c : done) {
+            --inFlight;
+            delete c;
+        }
+    }
+    backend.reset();
+    for (auto &job : active) {
+        close(job->fd);
+    }
+    for (auto &job : window) {
+        close(job->fd);
+    }
+}
+
+const char *FileReader::method() const
+{
+    return backend->name();
+}
+
+void FileReader::refillWindow()
+{
+    size_t count = min(maxWindow, max<size_t>(depth, 8));
+    for (; nextPath < paths.size() && window.size() < count; ++nextPath) {
+        auto job = make_unique<Job>();
+        job->index = nextPath;
+        job->path = paths[nextPath];
+        job->fd = open(job->path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (job->fd < 0 || fstat(job->fd, &st) != 0) {
+            finished.push_back({job->index, nullptr, "can't open " + job->path + ": " + strerror(errno)});
+            if (job->fd >= 0) {
+                close(job->fd);
+            }
+            continue;
+        }
+        job->size = uint64_t(st.st_size);
+        job->physical = firstBlock(job->fd);
+        window.push_back(move(job));
+    }
+    // files the file system can't place keep their order
+    stable_sort(window.begin(), window.end(), [](auto &a, auto &b) { return a->physical < b->physical; });
+}
+
+void FileReader::issue()
+{
+    while (inFlight < depth) {
+        // chunks of files already started first: they finish sooner
+        auto open = find_if(reading.begin(), reading.end(), [](Job *j) { return j->issued < j->size; });
+        Job *job = open != reading.end() ? *open : nullptr;
+        if (!job) {
+            if (window.empty()) {
+                refillWindow();
+            }
+            if (window.empty()) {
+                break;
+            }
+            uint64_t size = window.front()->size;
+            if (heldBytes > 0 && heldBytes + size > maxBytes) {
+                break;
+            }
+            job = window.front().get();
+            active.push_back(move(window.front()));
+            window.pop_front();
+            job->started = chrono::steady_clock::now();
+            job->buf = BufferPool::take(size_t(size));
+            heldBytes += size_t(size);
+            if (size == 0) {
+                finish(job);
+                continue;
+            }
+            reading.push_back(job);
+        }
+        auto *c = new Chunk{job, job->issued, {}};
+        size_t n = size_t(min<uint64_t>(chunkSize, job->size - job->issued));
+        c->iov.iov_base = job->buf.data() + job->issued;
+        c->iov.iov_len = n;
+        job->issued += n;
+        ++job->pending;
+        ++inFlight;
+        backend->read(c);
+    }
+    backend->submit();
+}
+
+void FileReader::complete(Chunk *c)
+{
+    Job *job = c->job;
+    --job->pending;
+    --inFlight;
+    if (c->result > 0 && size_t(c->result) < c->iov.iov_len && job->error.empty()) {
+        // short read: the rest again
+        c->offset += uint64_t(c->result);
+        c->iov.iov_base = static_cast<char *>(c->iov.iov_base) + c->result;
+        c->iov.iov_len -= size_t(c->result);
+        ++job->pending;
+        ++inFlight;
+        backend->read(c);
+        return;
+    }
+    if (job->error.empty() && c->result <= 0) {
+        job->error = c->result < 0 ? "can't read " + job->path + ": " + strerror(int(-c->result))
+                                   : job->path + " got shorter while it was read";
+        // no more chunks of this one
+        job->issued = job->size;
+    }
+    delete c;
+    if (job->pending == 0 && job->issued == job->size) {
+        finish(job);
+    }
+}
+
+void FileReader::finish(Job *job)
+{
+    close(job->fd);
+    Metrics::global().observe(Stage::Read, chrono::steady_clock::now() - job->started);
+    if (job->error.empty()) {
+        finished.push_back({job->index, make_unique<MemoryBuffer>(move(job->buf)), ""});
+    } else {
+        heldBytes -= size_t(job->size);
+        BufferPool::give(move(job->buf));
+        finished.push_back({job->index, nullptr, move(job->error)});
+    }
+    reading.erase(remove(reading.begin(), reading.end(), job), reading.end());
+    auto it = find_if(active.begin(), active.end(), [&](auto &j) { return j.get() == job; });
+    active.erase(it);
+}
+
+bool FileReader::next(Loaded &out)
+{
+    vector<Chunk *> done;
+    for (;;) {
+        issue();
+        if (!finished.empty()) {
+            out = move(finished.front());
+            finished.pop_front();
+            if (out.buffer) {
+                heldBytes -= out.buffer->size();
+            }
+            return true;
+        }
+        if (inFlight == 0) {
+            if (window.empty() && nextPath == paths.size()) {
+                return false;
+            }
+            continue;
+        }
+        done.clear();
+        backend->reap(done);
+        for (Chunk *c : done) {
+            complete(c);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "inputBuffer.h"
+
+/**
+  Reads whole files into memory with many reads in flight, for the loading
+  stage without memory mapping. Files are read in chunks through io_uring,
+  or by a few threads doing pread() where io_uring is not available (old
+  kernels, containers that block it). Within a window of files about to be
+  read the reads are issued in the order of the files' first block on
+  disk (FIEMAP), so a disk seeks forward instead of back and forth.
+  Finished files are returned in the order they complete, not in list order.
+ *
+ */
+class FileReader
+{
+public:
+    struct Loaded
+    {
+        size_t index;                           // in the paths given to the constructor
+        std::unique_ptr<InputBuffer> buffer;    // null if the file could not be read
+        std::string error;
+    };
+
+    // depth - chunks in flight; maxBytes - of files being read or finished and
+    // not taken by next() yet (one file bigger than that is still read on its own)
+    FileReader(std::vector<std::string> paths, size_t depth, size_t maxBytes);
+    FileReader(const FileReader &) = delete;
+    FileReader & operator=(const FileReader &) = delete;
+    ~FileReader();
+
+    // waits for the next finished file, false once every file was returned
+    bool next(Loaded &out);
+    // "io_uring" or "threads"
+    const char *method() const;
+
+    struct Job;
+    struct Chunk;
+    class Backend;
+private:
+    std::vector<std::string> paths;
+    size_t nextPath{0};
+    size_t depth;
+    size_t maxBytes;
+    size_t heldBytes{0};
+    size_t inFlight{0};     // chunks
+    std::unique_ptr<Backend> backend;
+    // opened, ordered by position on disk
+    std::deque<std::unique_ptr<Job>> window;
+    // being read, with chunks left to issue
+    std::vector<Job *> reading;
+    std::vector<std::unique_ptr<Job>> active;
+    std::deque<Loaded> finished;
+
+    void refillWindow();
+    void issue();
+    void complete(Chunk *chunk);
+    void finish(Job *job);
+};
@@ -0,0 +1,118 @@
+#include "inputBuffer.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const size_t maxPooledBuffers = 8;
+static const size_t maxPooledSize = size_t(16) << 20;
+
+static mutex poolMutex;
+static vector<vector<char>> pool;
+
+vector<char> BufferPool::take(size_t size)
+{
+    vector<char> buf;
+    {
+        lock_guard<mutex> l{poolMutex};
+        auto best = pool.end();
+        for (auto it = pool.begin(); it != pool.end(); ++it) {
+            if (it->capacity() >= size && (best == pool.end() || it->capacity() < best->capacity())) {
+                best = it;
+            }
+        }
+        if (best != pool.end()) {
+            buf = move(*best);
+            *best = move(pool.back());
+            pool.pop_back();
+        }
+    }
+    buf.resize(size);
+    return buf;
+}
+
+void BufferPool::give(vector<char> &&buf)
+{
+    if (buf.capacity() == 0 || buf.capacity() > maxPooledSize) {
+        return;
+    }
+    buf.clear();
+    lock_guard<mutex> l{poolMutex};
+    if (pool.size() < maxPooledBuffers) {
+        pool.push_back(move(buf));
+    } else {
+        // keep the bigger ones: they fit more files
+        auto smallest = min_element(pool.begin(), pool.end(),
+            [](const vector<char> &a, const vector<char> &b) { return a.capacity() < b.capacity(); });
+        if (smallest->capacity() < buf.capacity()) {
+            *smallest = move(buf);
+        }
+    }
+}
+
+MappedFile::MappedFile(const string &path, bool sequential)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw runtime_error("can't open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        throw runtime_error("can't stat " + path + ": " + strerror(err));
+    }
+    length = size_t(st.st_size);
+    if (length > 0) {
+        addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    int err = errno;
+    close(fd);  // the mapping keeps the file referenced
+    if (addr == MAP_FAILED) {
+        addr = nullptr;
+        throw runtime_error("can't map " + path + ": " + strerror(err));
+    }
+    if (!addr || !sequential) {
+        return;
+    }
+    // demuxers read front to back: ask for aggressive readahead
+    // and start it now, while the file still waits in the queue
+    madvise(addr, length, MADV_SEQUENTIAL);
+    madvise(addr, length, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    // only honoured by kernels with file-backed THP, harmless elsewhere
+    if (length >= (size_t(2) << 20)) {
+        madvise(addr, length, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    if (addr) {
+        munmap(addr, length);
+    }
+}
+
+unique_ptr<InputBuffer> loadFile(const string &path, bool useMmap, bool wholeFile)
+{
+    if (useMmap) {
+        return make_unique<MappedFile>(path, wholeFile);
+    }
+    ifstream f(path, ios::binary | ios::ate);
+    if (!f) {
+        throw runtime_error("can't open " + path);
+    }
+    vector<char> buf = BufferPool::take(size_t(f.tellg()));
+    f.seekg(0);
+    f.read(buf.data(), buf.size());
+    return make_unique<MemoryBuffer>(move(buf));
+}
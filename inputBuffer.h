@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+  Read-only view of one compressed audio file in memory
+ *
+ */
+class InputBuffer
+{
+public:
+    virtual ~InputBuffer() = default;
+    virtual const uint8_t *data() const = 0;
+    virtual size_t size() const = 0;
+};
+
+/**
+  Read buffers of finished files for the next ones: files are read on the
+  loader thread and released on the workers, so this one is shared.
+  Keeps a few buffers of moderate size; big files are rare and their
+  read dominates anyway
+ *
+ */
+class BufferPool
+{
+public:
+    // buffer of size bytes, reusing the smallest kept one that fits
+    static std::vector<char> take(size_t size);
+    static void give(std::vector<char> &&buf);
+};
+
+// file contents copied into a heap vector, handed back to BufferPool when done
+class MemoryBuffer : public InputBuffer
+{
+    std::vector<char> buf;
+public:
+    explicit MemoryBuffer(std::vector<char> &&v) : buf(std::move(v)) {}
+    MemoryBuffer(const MemoryBuffer &) = delete;
+    MemoryBuffer & operator=(const MemoryBuffer &) = delete;
+    ~MemoryBuffer() override { BufferPool::give(std::move(buf)); }
+    const uint8_t *data() const override { return reinterpret_cast<const uint8_t *>(buf.data()); }
+    size_t size() const override { return buf.size(); }
+};
+
+/**
+  File mapped read-only into memory: no read() and no copy,
+  pages are faulted in from the page cache while FFmpeg demuxes.
+  Note: truncating the file while it is mapped raises SIGBUS.
+ *
+ */
+class MappedFile : public InputBuffer
+{
+    void *addr{nullptr};
+    size_t length{0};
+public:
+    // sequential - the whole file will be read: start readahead now
+    explicit MappedFile(const std::string &path, bool sequential = true);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+    ~MappedFile();
+    const uint8_t *data() const override { return static_cast<const uint8_t *>(addr); }
+    size_t size() const override { return length; }
+};
+
+/**
+  Open file for decoding, either mapped (useMmap) or read into memory;
+  wholeFile = false: only some of it will be read (probing headers),
+  a mapping then reads no more than the pages touched
+  throws std::runtime_error if the file can't be opened
+ *
+ */
+std::unique_ptr<InputBuffer> loadFile(const std::string &path, bool useMmap, bool wholeFile = true);
@@ -0,0 +1,166 @@
+#include "journal.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const string journalHeader = "#AudioAnalyzer journal v1\n";
+
+// names are one line each: escape backslash and newline
+static string escape(const string &s)
+{
+    string r;
+    r.reserve(s.size());
+    for (char c : s) {
+        if (c == '\\') r += "\\\\";
+        else if (c == '\n') r += "\\n";
+        else r += c;
+    }
+    return r;
+}
+
+static string unescape(const string &s)
+{
+    string r;
+    r.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            r += s[++i] == 'n' ? '\n' : s[i];
+        } else {
+            r += s[i];
+        }
+    }
+    return r;
+}
+
+static string readAll(int fd)
+{
+    string text;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("can't read journal: ") + strerror(errno));
+        }
+        text.append(buf, size_t(n));
+    }
+    return text;
+}
+
+static void writeAll(int fd, const string &s)
+{
+    const char *p = s.data();
+    size_t n = s.size();
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            throw runtime_error(string("can't write journal: ") + strerror(errno));
+        }
+        p += w;
+        n -= size_t(w);
+    }
+}
+
+// cut path back to size bytes: rows written after the checkpoint
+static void cutTo(const string &path, uint64_t size)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || uint64_t(st.st_size) < size) {
+        throw runtime_error(path + " is shorter than the journal says it is, run without --resume");
+    }
+    if (uint64_t(st.st_size) > size && truncate(path.c_str(), off_t(size)) != 0) {
+        throw runtime_error("can't truncate " + path + ": " + strerror(errno));
+    }
+}
+
+Journal::Journal(const string &path, bool resume, const string &csvPath, const string &errorPath) : path(path)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw runtime_error("can't open journal " + path + ": " + strerror(errno));
+    }
+    try {
+        load(resume, csvPath, errorPath);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+void Journal::load(bool resume, const string &csvPath, const string &errorPath)
+{
+    size_t valid = 0;   // bytes up to the end of the last checkpoint
+    if (resume) {
+        string text = readAll(fd);
+        if (text.compare(0, journalHeader.size(), journalHeader) == 0) {
+            vector<string> batch;
+            uint64_t csvBytes = 0, errorBytes = 0;
+            size_t start = journalHeader.size();
+            // a line without its newline is torn: it and everything after the checkpoint is dropped
+            for (size_t end; (end = text.find('\n', start)) != string::npos; start = end + 1) {
+                string line = text.substr(start, end - start);
+                if (line.size() > 2 && (line[0] == '+' || line[0] == '-') && line[1] == '\t') {
+                    batch.push_back(unescape(line.substr(2)));
+                } else if (line.size() > 2 && line[0] == '@' && line[1] == '\t') {
+                    unsigned long long c, e;
+                    if (sscanf(line.c_str() + 2, "%llu\t%llu", &c, &e) != 2) {
+                        break;
+                    }
+                    csvBytes = c;
+                    errorBytes = e;
+                    finished.insert(batch.begin(), batch.end());
+                    batch.clear();
+                    valid = end + 1;
+                } else {
+                    break;
+                }
+            }
+            if (valid > 0) {
+                resumed_ = true;
+                cutTo(csvPath, csvBytes);
+                cutTo(errorPath, errorBytes);
+            }
+        }
+    }
+    if (!resumed_) {
+        finished.clear();
+        valid = journalHeader.size();
+    }
+    if (ftruncate(fd, off_t(resumed_ ? valid : 0)) != 0 || lseek(fd, 0, SEEK_END) < 0) {
+        throw runtime_error("can't reset journal " + path + ": " + strerror(errno));
+    }
+    if (!resumed_) {
+        writeAll(fd, journalHeader);
+    }
+}
+
+Journal::~Journal()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+string Journal::entry(const string &name, bool failed)
+{
+    return string(failed ? "-" : "+") + "\t" + escape(name) + "\n";
+}
+
+void Journal::commit(const string &entries, uint64_t csvBytes, uint64_t errorBytes)
+{
+    char checkpoint[64];
+    snprintf(checkpoint, sizeof checkpoint, "@\t%llu\t%llu\n", (unsigned long long)csvBytes,
+             (unsigned long long)errorBytes);
+    writeAll(fd, entries + checkpoint);
+    if (fdatasync(fd) != 0) {
+        throw runtime_error("can't sync journal " + path + ": " + strerror(errno));
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+
+/**
+  Append-only record of the files a run has finished, for --resume.
+  The result writer commits the files of a batch once their CSV and error
+  rows are on disk, followed by a checkpoint with the sizes of both files.
+  On resume everything after the last checkpoint is cut from the journal,
+  the CSV and the error file: a run killed at any point goes on with whole
+  rows, no duplicates, and only redoes the files after the checkpoint.
+ *
+ */
+class Journal
+{
+    std::string path;
+    int fd{-1};
+    bool resumed_{false};
+    std::unordered_set<std::string> finished;
+public:
+    // resume: continue the journal at path and cut csvPath and errorPath back
+    // to its last checkpoint; otherwise (or if there is none) start a new one.
+    // throws std::runtime_error if the files don't match the journal
+    Journal(const std::string &path, bool resume, const std::string &csvPath, const std::string &errorPath);
+    Journal(const Journal &) = delete;
+    Journal & operator=(const Journal &) = delete;
+    ~Journal();
+
+    // an earlier run's journal is continued: append to its CSV
+    bool resumed() const { return resumed_; }
+    // file has a row in the CSV or the error file from an earlier run
+    bool done(const std::string &name) const { return finished.count(name) > 0; }
+    size_t doneCount() const { return finished.size(); }
+
+    // journal line of one file
+    static std::string entry(const std::string &name, bool failed);
+    // append entries and a checkpoint with the output file sizes, then sync;
+    // the rows of entries must be on disk already
+    void commit(const std::string &entries, uint64_t csvBytes, uint64_t errorBytes);
+private:
+    void load(bool resume, const std::string &csvPath, const std::string &errorPath);
+};
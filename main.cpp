@@ -5,43 +5,325 @@
 #include <filesystem>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <csignal>
 #include "worker.h"
+#include "options.h"
+#include "scanner.h"
+#include "metrics.h"
+#include "supervisor.h"
+#include "fftWisdom.h"
+#include "fileReader.h"
+#include "analysis.h"
+#include "archive.h"
+#include "watcher.h"
 
 using namespace std;
 
+// --watch: a file is analyzed once it was left alone this long after writing
+static const chrono::seconds watchSettle{2};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+    stopRequested = 1;
+}
+
 int main(int argc, char**argv) {
-    if (argc != 3) {
-        cout << "Wrong number of params. Use: AudioAnalyzer <folder with audio files> <result CSV file path>" << endl;
+    Options options;
+    try {
+        options = parseOptions(argc, argv);
+    } catch (invalid_argument &ex) {
+        cout << ex.what() << " " << usage() << endl;
         return 0;
     }
-    string path(argv[1]);
-    string csvPath(argv[2]);
-    ofstream resultCSV(csvPath);
-    resultCSV << "File Name,Duration,Frequency,Key,Tempo" << endl;
-    
+    makeFftPlannerThreadSafe();
+    // worker processes load the file their supervisor saved
+    if (!options.fftWisdom.empty() && !prepareFftWisdom(options.fftWisdom, options.decode.analysisRate)) {
+        cout << "can't save FFT wisdom to " << options.fftWisdom << endl;
+    }
+    if (options.workerProcess) {
+        return workerProcess(options);
+    }
+    const string &path = options.inputPath;
+
     try{
-        ThreadPool pool{thread::hardware_concurrency() - 1};
-        for (const auto & entry : filesystem::directory_iterator(path)) {
-            string src{entry.path()}, name{entry.path().stem()};
+        // files are loaded here while the pool decodes earlier ones;
+        // submit() blocks once queueDepth files or queueBytes are held
+        // CSV columns of the enabled analyzers
+        vector<string> columns = analyzerColumns(options.decode.analyzers);
+        unique_ptr<AnalysisCache> cache;
+        if (!options.cachePath.empty()) {
+            cache = make_unique<AnalysisCache>(options.cachePath, columns, resultSettings(options.decode));
+        }
+        // before the writer opens the CSV: resuming cuts it back to the last checkpoint
+        Journal journal(options.csvPath + ".journal", options.resume, options.csvPath, options.errorPath);
+        if (options.resume && !journal.resumed()) {
+            cout << "no journal of an earlier run, starting from the beginning" << endl;
+        }
+        ResultWriter writer(options.csvPath, options.errorPath, columns, cache.get(), &journal);
+        unique_ptr<SegmentAgreement> agreement;
+        if (options.compareFull) {
+            agreement = make_unique<SegmentAgreement>(columns);
+        }
+        // a file instead of a folder: the members of a tar or zip archive, read in place
+        unique_ptr<Archive> archive;
+        if (Archive::isArchive(path)) {
+            archive = make_unique<Archive>(path);
+        }
+        // without mmap the files are read with many reads in flight, in a quarter of the memory budget
+        bool readAhead = options.processes == 0 && !options.mmap && !options.decode.probeOnly && !archive;
+        size_t readBytes = readAhead ? options.queueBytes / 4 : 0;
+        // one of the two runs the analysis
+        unique_ptr<ThreadPool> pool;
+        unique_ptr<Supervisor> supervisor;
+        if (options.processes > 0) {
+            supervisor = make_unique<Supervisor>(argc, argv, options.processes, chrono::seconds(options.timeout), writer);
+        } else {
+            pool = make_unique<ThreadPool>(options.threads, options.queueDepth, options.queueBytes - readBytes);
+        }
+        // before the scan: a file written while it runs is not missed
+        unique_ptr<DirectoryWatcher> watcher;
+        if (options.watch) {
+            if (archive) {
+                throw runtime_error("--watch needs a folder, not an archive");
+            }
+            watcher = make_unique<DirectoryWatcher>(path, options.scan.recursive, watchSettle);
+            struct sigaction stop{};
+            stop.sa_handler = requestStop;
+            // no SA_RESTART: the watcher's wait returns
+            sigaction(SIGINT, &stop, nullptr);
+            sigaction(SIGTERM, &stop, nullptr);
+        }
+        ScanResult scan = archive ? scanArchive(*archive, options.scan) : scanFolder(path, options.scan);
+        for (auto &e : scan.errors) {
+            cout << e << endl;
+        }
+        auto &files = scan.files;
+        if (journal.resumed()) {
+            size_t before = files.size();
+            files.erase(remove_if(files.begin(), files.end(), [&](auto &f) { return journal.done(f.name); }),
+                        files.end());
+            cout << before - files.size() << " file(s) done by the interrupted run, resuming" << endl;
+        }
+        if (options.largestFirst) {
+            // longest tasks first: the run doesn't end waiting for one big file started last
+            stable_sort(files.begin(), files.end(), [](auto &a, auto &b) { return a.size > b.size; });
+        }
+        Metrics &metrics = Metrics::global();
+        metrics.filesScheduled = files.size();
+        MetricsReporter reporter(metrics, options.metricsPath, chrono::seconds(options.metricsInterval), &cout);
+        auto load = [&](const ScannedFile &file) {
+            StageTimer timer(Stage::Read);
+            // probing touches only the headers of a mapped file
+            auto input = archive ? archive->open(file.member, !options.decode.probeOnly)
+                                 : loadFile(file.path, options.mmap, !options.decode.probeOnly);
+            metrics.bytesRead += input->size();
+            return input;
+        };
+        // an archive member's own size and time: rewriting the archive doesn't invalidate the others
+        auto keyOf = [&](const ScannedFile &file) {
+            if (!archive) {
+                return cacheKeyOf(filesystem::absolute(file.path));
+            }
+            auto &member = archive->members()[file.member];
+            return CacheKey{filesystem::absolute(path).string() + ":" + member.name, member.size, member.mtime, 0};
+        };
+        // unchanged since the last run: reuse the stored result
+        auto fromCache = [&](const CacheKey &key, const string &name) {
+            AnalysisResult cached;
+            if (!cache->lookup(key, cached)) {
+                return false;
+            }
+            ++metrics.filesCached;
+            cached.name = name;
+            writer.write(move(cached));
+            return true;
+        };
+        // files left for the reader, with their cache key
+        vector<pair<const ScannedFile *, CacheKey>> toRead;
+        // --watch: size and time of every file scheduled, so the watcher's
+        // reports of files the run already has (after an overflow) are dropped
+        map<string, pair<uint64_t, int64_t>> known;
+        auto remember = [&](const ScannedFile &file, const CacheKey &key) {
+            try {
+                CacheKey k = key.path.empty() ? keyOf(file) : key;
+                known[file.path] = {k.size, k.mtime};
+            } catch (runtime_error &) {
+                // gone already: reported again if it comes back
+            }
+        };
+        auto unchanged = [&](const ScannedFile &file) {
+            auto it = known.find(file.path);
+            if (it == known.end()) {
+                return false;
+            }
+            try {
+                CacheKey k = keyOf(file);
+                return it->second == make_pair(k.size, k.mtime);
+            } catch (runtime_error &) {
+                return false;
+            }
+        };
+        // cache lookup, then to the reader, the pool or a worker process;
+        // viaReader - file stays in files until the reader is done
+        auto schedule = [&](const ScannedFile &file, bool viaReader) {
+            const string &src{file.path}, &name{file.name};
             cout << src << endl;
-            auto filesize = filesystem::file_size(src);
-            if (filesize <= 0) throw(new invalid_argument("file is empty: " + name));
-            ifstream f(src, ios::binary);
-            vector<char> buf;
-            buf.resize(filesize);
-            f.read(buf.data(), filesize);
-            //auto w = new Worker(move(buf), resultCSV, name);
-            pool.submit(Worker(move(buf), resultCSV, name));            
-        }
-        while(!pool.done()) {
-            int percent{pool.getPercentDone()};
-            cout << percent << "%\r" << flush;
-            if (percent == 100) break;
-            this_thread::sleep_for(1s);
-        }
-        cout << pool.getTotalDone() << " file(s) processed\n";
-        if (pool.exception) {
-            std::rethrow_exception(pool.exception);
+            unique_ptr<InputBuffer> input;
+            CacheKey key;
+            // comparing needs every file analyzed
+            if (cache && !agreement) {
+                key = keyOf(file);
+                if (fromCache(key, name)) {
+                    return;
+                }
+                // read ahead: hashed once the reader has it
+                if (options.cacheHash && !viaReader) {
+                    input = load(file);
+                    try {
+                        key.hash = contentHash(*input);
+                    } catch (runtime_error &e) {
+                        // a damaged archive member, found inflating it
+                        ++metrics.filesFailed;
+                        writer.error(name, e.what());
+                        return;
+                    }
+                    if (fromCache(key, name)) {
+                        return;
+                    }
+                }
+            } else if (cache) {
+                key = keyOf(file);
+            }
+            if (watcher) {
+                remember(file, key);
+            }
+            if (supervisor) {
+                // the worker process reads the file itself, an archive member by its index
+                supervisor->submit(archive ? to_string(file.member) : src, name, move(key), file.size);
+                return;
+            }
+            if (viaReader) {
+                toRead.emplace_back(&file, move(key));
+                return;
+            }
+            if (!input) {
+                input = load(file);
+            }
+            pool->submit(Worker(move(input), writer, options.decode, name, move(key), agreement.get(), pool.get()));
+        };
+        size_t scheduled = 0;
+        for (const auto &file : files) {
+            if (stopRequested) {
+                break;
+            }
+            if (watcher) {
+                // files written meanwhile wait in pending, not in the kernel's queue
+                watcher->drain();
+            }
+            try {
+                schedule(file, readAhead);
+            } catch (runtime_error &e) {
+                // removed or unreadable since the scan: costs the file, not the run
+                ++metrics.filesFailed;
+                writer.error(file.name, e.what());
+            }
+            ++scheduled;
+        }
+        // the rest never get a row: don't wait for them
+        metrics.filesScheduled -= files.size() - scheduled;
+        if (!toRead.empty()) {
+            vector<string> paths;
+            for (auto &f : toRead) {
+                paths.push_back(f.first->path);
+            }
+            FileReader reader(move(paths), options.ioDepth, readBytes);
+            cout << "reading " << toRead.size() << " file(s) with " << reader.method() << ", " << options.ioDepth
+                 << " reads in flight" << endl;
+            // in the order the reads finish: decoding starts on whatever the disk delivered first
+            FileReader::Loaded loaded;
+            size_t delivered = 0;
+            while (!stopRequested && reader.next(loaded)) {
+                ++delivered;
+                if (watcher) {
+                    watcher->drain();
+                }
+                const ScannedFile &file = *toRead[loaded.index].first;
+                CacheKey &key = toRead[loaded.index].second;
+                if (!loaded.buffer) {
+                    ++metrics.filesFailed;
+                    writer.error(file.name, loaded.error);
+                    continue;
+                }
+                metrics.bytesRead += loaded.buffer->size();
+                if (cache && !agreement && options.cacheHash) {
+                    key.hash = contentHash(*loaded.buffer);
+                    if (fromCache(key, file.name)) {
+                        continue;
+                    }
+                }
+                pool->submit(Worker(move(loaded.buffer), writer, options.decode, file.name, move(key),
+                                    agreement.get(), pool.get()));
+            }
+            // stopped: the reads still in flight are dropped with the reader
+            metrics.filesScheduled -= toRead.size() - delivered;
+        }
+        if (watcher) {
+            cout << "watching " << path << " for new files, stop with Ctrl+C" << endl;
+            while (!stopRequested) {
+                for (auto &rel : watcher->next(1s)) {
+                    ScannedFile file;
+                    // rewritten with the same size and time, or reported again after an overflow
+                    if (!scanFile(path, rel, options.scan, file) || unchanged(file)) {
+                        continue;
+                    }
+                    ++metrics.filesScheduled;
+                    try {
+                        schedule(file, false);
+                    } catch (runtime_error &e) {
+                        // removed again before it was read: costs the file, not the daemon
+                        ++metrics.filesFailed;
+                        writer.error(file.name, e.what());
+                    }
+                }
+            }
+            cout << "stopped watching, finishing the files started" << endl;
+        }
+        if (supervisor) {
+            supervisor->finish();
+        }
+        // done when every file has its row in the CSV or error file, not just when tasks finish
+        while (pool && !pool->done() && metrics.resultsWritten + pool->failedTasks() < metrics.filesScheduled) {
+            this_thread::sleep_for(100ms);
+        }
+        writer.close();
+        reporter.stop();
+        cout << (pool ? size_t(pool->getTotalDone()) : supervisor->done()) << " file(s) processed, "
+             << scan.rejected << " non-audio file(s) skipped\n";
+        if (agreement) {
+            agreement->print(cout);
+        }
+        if (cache) {
+            cout << cache->hitCount() << " file(s) unchanged, taken from " << options.cachePath << "\n";
+            cache->compact();
+        }
+        metrics.summary(cout);
+        if (supervisor) {
+            cout << supervisor->capacity() << " worker process(es), " << supervisor->restarts()
+                 << " restarted after a crash or timeout\n";
+            return 0;
+        }
+        auto busy = pool->busySeconds();
+        auto [minBusy, maxBusy] = minmax_element(busy.begin(), busy.end());
+        cout << "core utilization: " << int(pool->utilization() * 100 + 0.5) << "% of " << pool->capacity()
+             << " thread(s), busy per thread " << fixed << setprecision(1) << *minBusy << "-" << *maxBusy
+             << "s, " << pool->steals() << " task(s) stolen\n";
+        if (pool->exception) {
+            std::rethrow_exception(pool->exception);
         }
     }
     catch(exception& ex) {
@@ -0,0 +1,231 @@
+#include "metrics.h"
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+const double Histogram::upper[Histogram::bounds] = {
+    0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05,
+    0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100,
+};
+
+const char *stageName(Stage stage)
+{
+    switch (stage) {
+    case Stage::Read:      return "read";
+    case Stage::QueueWait: return "queue_wait";
+    case Stage::Decode:    return "decode";
+    case Stage::Key:       return "key";
+    case Stage::Tempo:     return "tempo";
+    case Stage::Features:  return "features";
+    case Stage::Write:     return "write";
+    default:               return "";
+    }
+}
+
+void Histogram::observe(chrono::nanoseconds duration)
+{
+    double s = duration.count() * 1e-9;
+    size_t i = 0;
+    while (i < bounds && s > upper[i]) {
+        ++i;
+    }
+    buckets[i].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sumNs.fetch_add(duration.count(), memory_order_relaxed);
+}
+
+uint64_t Histogram::cumulative(size_t i) const
+{
+    uint64_t n = 0;
+    for (size_t k = 0; k <= i && k <= bounds; ++k) {
+        n += buckets[k].load(memory_order_relaxed);
+    }
+    return n;
+}
+
+double Histogram::quantile(double q) const
+{
+    uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    double rank = q * n, below = 0;
+    for (size_t i = 0; i <= bounds; ++i) {
+        double inBucket = double(buckets[i].load(memory_order_relaxed));
+        if (below + inBucket >= rank && inBucket > 0) {
+            if (i == bounds) {
+                return upper[bounds - 1];
+            }
+            double lo = i ? upper[i - 1] : 0;
+            return lo + (upper[i] - lo) * (rank - below) / inBucket;
+        }
+        below += inBucket;
+    }
+    return upper[bounds - 1];
+}
+
+Metrics & Metrics::global()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+static double secondsSince(chrono::steady_clock::time_point t)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - t).count();
+}
+
+string Metrics::json() const
+{
+    ostringstream os;
+    os << setprecision(6);
+    os << "{\n  \"uptime_seconds\": " << secondsSince(started) << ",\n"
+       << "  \"files\": {\"scheduled\": " << filesScheduled << ", \"analyzed\": " << filesAnalyzed
+       << ", \"failed\": " << filesFailed << ", \"cached\": " << filesCached
+       << ", \"written\": " << resultsWritten << "},\n"
+       << "  \"tasks\": {\"queued\": " << tasksQueued << ", \"running\": " << tasksRunning << "},\n"
+       << "  \"bytes_read\": " << bytesRead << ",\n"
+       << "  \"audio_seconds\": " << audioMicroseconds * 1e-6 << ",\n"
+       << "  \"stages\": {";
+    for (size_t s = 0; s < stages.size(); ++s) {
+        const Histogram &h = stages[s];
+        os << (s ? "," : "") << "\n    \"" << stageName(Stage(s)) << "\": {\"count\": " << h.count()
+           << ", \"sum_seconds\": " << h.sumSeconds() << ", \"p50_seconds\": " << h.quantile(0.5)
+           << ", \"p95_seconds\": " << h.quantile(0.95) << ", \"buckets\": [";
+        for (size_t i = 0; i <= Histogram::bounds; ++i) {
+            os << (i ? ", " : "") << "[";
+            if (i < Histogram::bounds) os << Histogram::upper[i]; else os << "\"+Inf\"";
+            os << ", " << h.cumulative(i) << "]";
+        }
+        os << "]}";
+    }
+    os << "\n  }\n}\n";
+    return os.str();
+}
+
+string Metrics::prometheus() const
+{
+    ostringstream os;
+    os << setprecision(6);
+    const string p = "audioanalyzer_";
+    os << "# HELP " << p << "stage_seconds Time spent per file (per batch for write) in each pipeline stage.\n"
+       << "# TYPE " << p << "stage_seconds histogram\n";
+    for (size_t s = 0; s < stages.size(); ++s) {
+        const Histogram &h = stages[s];
+        string label = string("stage=\"") + stageName(Stage(s)) + "\"";
+        for (size_t i = 0; i <= Histogram::bounds; ++i) {
+            os << p << "stage_seconds_bucket{" << label << ",le=\"";
+            if (i < Histogram::bounds) os << Histogram::upper[i]; else os << "+Inf";
+            os << "\"} " << h.cumulative(i) << "\n";
+        }
+        os << p << "stage_seconds_sum{" << label << "} " << h.sumSeconds() << "\n"
+           << p << "stage_seconds_count{" << label << "} " << h.count() << "\n";
+    }
+    os << "# TYPE " << p << "files_total counter\n"
+       << p << "files_total{result=\"analyzed\"} " << filesAnalyzed << "\n"
+       << p << "files_total{result=\"failed\"} " << filesFailed << "\n"
+       << p << "files_total{result=\"cached\"} " << filesCached << "\n"
+       << "# TYPE " << p << "files_scheduled gauge\n" << p << "files_scheduled " << filesScheduled << "\n"
+       << "# TYPE " << p << "results_written_total counter\n" << p << "results_written_total " << resultsWritten << "\n"
+       << "# TYPE " << p << "read_bytes_total counter\n" << p << "read_bytes_total " << bytesRead << "\n"
+       << "# TYPE " << p << "audio_seconds_total counter\n" << p << "audio_seconds_total " << audioMicroseconds * 1e-6 << "\n"
+       << "# TYPE " << p << "tasks_queued gauge\n" << p << "tasks_queued " << tasksQueued << "\n"
+       << "# TYPE " << p << "tasks_running gauge\n" << p << "tasks_running " << tasksRunning << "\n"
+       << "# TYPE " << p << "uptime_seconds gauge\n" << p << "uptime_seconds " << secondsSince(started) << "\n";
+    return os.str();
+}
+
+void Metrics::summary(ostream &os) const
+{
+    auto flags = os.flags();
+    os << "stage          count    total s    mean ms     p50 ms     p95 ms\n" << fixed;
+    for (size_t s = 0; s < stages.size(); ++s) {
+        const Histogram &h = stages[s];
+        uint64_t n = h.count();
+        os << left << setw(11) << stageName(Stage(s)) << right << setw(9) << n << setprecision(1)
+           << setw(11) << h.sumSeconds() << setw(11) << (n ? h.sumSeconds() * 1000 / n : 0.0)
+           << setw(11) << h.quantile(0.5) * 1000 << setw(11) << h.quantile(0.95) * 1000 << "\n";
+    }
+    double wall = secondsSince(started), audio = audioMicroseconds * 1e-6;
+    os << setprecision(1) << bytesRead / 1e6 << " MB read, " << audio / 3600 << " h of audio analyzed in "
+       << wall << " s (" << setprecision(0) << (wall > 0 ? audio / wall : 0) << "x real time)\n";
+    os.flags(flags);
+}
+
+MetricsReporter::MetricsReporter(const Metrics &metrics, string path, chrono::seconds interval, ostream *progress)
+    : metrics(metrics), path(move(path)), interval(interval), progress(progress),
+      lastTime(chrono::steady_clock::now())
+{
+    thread = std::thread(&MetricsReporter::run, this);
+}
+
+MetricsReporter::~MetricsReporter()
+{
+    stop();
+}
+
+void MetricsReporter::stop()
+{
+    if (!thread.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> l{m};
+        stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+    writeFile();
+}
+
+void MetricsReporter::run()
+{
+    auto nextWrite = chrono::steady_clock::now() + interval;
+    unique_lock<mutex> l{m};
+    while (!cv.wait_for(l, chrono::seconds(1), [this] { return stopping; })) {
+        if (progress) {
+            printProgress();
+        }
+        if (chrono::steady_clock::now() >= nextWrite) {
+            writeFile();
+            nextWrite += interval;
+        }
+    }
+}
+
+void MetricsReporter::writeFile() const
+{
+    if (path.empty()) {
+        return;
+    }
+    bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+    // readers never see a half written file
+    string tmp = path + ".tmp";
+    {
+        ofstream os(tmp, ios::trunc);
+        os << (json ? metrics.json() : metrics.prometheus());
+        if (!os) {
+            return;   // metrics are best effort, the analysis goes on
+        }
+    }
+    rename(tmp.c_str(), path.c_str());
+}
+
+void MetricsReporter::printProgress()
+{
+    auto now = chrono::steady_clock::now();
+    uint64_t bytes = metrics.bytesRead;
+    double dt = chrono::duration<double>(now - lastTime).count();
+    double mbps = dt > 0 ? (bytes - lastBytes) / dt / 1e6 : 0;
+    lastBytes = bytes;
+    lastTime = now;
+    // formatted apart: the stream is shared with the main thread, its flags must not change
+    ostringstream line;
+    line << metrics.resultsWritten << "/" << metrics.filesScheduled << " done, " << metrics.tasksRunning
+         << " running, " << metrics.tasksQueued << " queued, " << fixed << setprecision(1) << mbps
+         << " MB/s read   \r";
+    *progress << line.str() << flush;
+}
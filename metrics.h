@@ -0,0 +1,112 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// pipeline steps with their own latency histogram
+// Features: the analyzers other than key and tempo, together
+enum class Stage { Read, QueueWait, Decode, Key, Tempo, Features, Write, Count };
+
+const char *stageName(Stage stage);
+
+/**
+  Latency histogram with fixed buckets from 100 us to 100 s (1-2-5 steps);
+  observe() is a few relaxed atomic increments, safe from any thread
+ *
+ */
+class Histogram
+{
+public:
+    static constexpr size_t bounds = 19;
+    static const double upper[bounds];  // seconds, the last bucket is +Inf
+
+    void observe(std::chrono::nanoseconds duration);
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    double sumSeconds() const { return sumNs.load(std::memory_order_relaxed) * 1e-9; }
+    // observations <= upper[i]; i == bounds gives all of them
+    uint64_t cumulative(size_t i) const;
+    // estimated from the buckets, linear within a bucket
+    double quantile(double q) const;
+private:
+    std::array<std::atomic<uint64_t>, bounds + 1> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<int64_t> sumNs{0};
+};
+
+/**
+  Counters, gauges and stage histograms of one run.
+  Updated by the pool, the workers and the result writer,
+  read by MetricsReporter
+ *
+ */
+struct Metrics
+{
+    std::array<Histogram, size_t(Stage::Count)> stages;
+    std::atomic<uint64_t> filesScheduled{0};   // files of the run, known after the scan
+    std::atomic<uint64_t> filesAnalyzed{0};
+    std::atomic<uint64_t> filesFailed{0};
+    std::atomic<uint64_t> filesCached{0};
+    std::atomic<uint64_t> resultsWritten{0};   // rows in the CSV or error file
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> audioMicroseconds{0};
+    std::atomic<int64_t> tasksQueued{0};
+    std::atomic<int64_t> tasksRunning{0};
+    std::chrono::steady_clock::time_point started{std::chrono::steady_clock::now()};
+
+    void observe(Stage stage, std::chrono::nanoseconds duration) { stages[size_t(stage)].observe(duration); }
+
+    std::string json() const;
+    // Prometheus text exposition format
+    std::string prometheus() const;
+    // table of the stages and totals for the end of the run
+    void summary(std::ostream &os) const;
+
+    static Metrics & global();
+};
+
+/**
+  Background thread writing the metrics to path every interval
+  (JSON if path ends in .json, Prometheus text otherwise, replaced atomically)
+  and a progress line to progress every second.
+  stop() writes the file a last time.
+ *
+ */
+class MetricsReporter
+{
+    const Metrics &metrics;
+    std::string path;
+    std::chrono::seconds interval;
+    std::ostream *progress;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping{false};
+    std::thread thread;
+public:
+    MetricsReporter(const Metrics &metrics, std::string path, std::chrono::seconds interval, std::ostream *progress);
+    MetricsReporter(const MetricsReporter &) = delete;
+    MetricsReporter & operator=(const MetricsReporter &) = delete;
+    ~MetricsReporter();
+    void stop();
+private:
+    void run();
+    void writeFile() const;
+    void printProgress();
+    uint64_t lastBytes{0};
+    std::chrono::steady_clock::time_point lastTime;
+};
+
+// adds the time until it goes out of scope to a stage of the global metrics
+class StageTimer
+{
+    Stage stage;
+    std::chrono::steady_clock::time_point start{std::chrono::steady_clock::now()};
+public:
+    explicit StageTimer(Stage stage) : stage(stage) {}
+    ~StageTimer() { Metrics::global().observe(stage, std::chrono::steady_clock::now() - start); }
+};
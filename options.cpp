@@ -0,0 +1,243 @@
+#include "options.h"
+#include "analysis.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static size_t toNumber(const string &name, const string &value)
+{
+    size_t pos{0};
+    unsigned long long n{0};
+    try {
+        n = stoull(value, &pos);
+    } catch (exception &) {
+        pos = 0;
+    }
+    if (pos == 0 || pos != value.size()) {
+        throw invalid_argument("bad value for " + name + ": " + value);
+    }
+    return n;
+}
+
+string usage()
+{
+    return "Use: AudioAnalyzer [options] <folder or tar/zip archive with audio files> <result CSV file path>\n"
+           "Options:\n"
+           "  --threads N        number of analysis threads (default: cores - 1)\n"
+           "  --errors PATH      CSV list of files that failed (default: bad.txt)\n"
+           "  --queue-depth N    max loaded files waiting for a thread (default: 2 x threads)\n"
+           "  --queue-mb N       max MB of loaded audio held in memory (default: 256)\n"
+           "  --no-mmap          read files into memory instead of mapping them\n"
+           "  --io-depth N       with --no-mmap: reads in flight at once (default: 32)\n"
+           "  --order size|dir   process largest files first (default) or in directory order\n"
+           "  --cache PATH       file with results of earlier runs (default: <result CSV>.cache)\n"
+           "  --no-cache         analyze every file, don't read or write the cache\n"
+           "  --cache-hash       also recognize unchanged files by content hash\n"
+           "  --include GLOB     only analyze files matching GLOB (relative path, may repeat)\n"
+           "  --exclude GLOB     skip files matching GLOB (relative path, may repeat)\n"
+           "  --no-recursive     don't descend into sub folders\n"
+           "  --no-sniff         don't check file signatures, pass every file to ffmpeg\n"
+           "  --scan-threads N   threads listing folders (default: 8)\n"
+           "  --analysis-rate N  resample audio to N Hz before analysis, 0 = file's rate (default: 22050)\n"
+           "  --channels mix|first  analyze the mix of all channels (default) or the first one\n"
+           "  --analyzers LIST   comma separated, in CSV column order: key,tempo,loudness,levels,centroid\n"
+           "                     (default: key,tempo)\n"
+           "  --segments N       analyze only N segments spread over each track, 0 = whole track (default: 0)\n"
+           "  --segment-seconds S  length of one segment (default: 30)\n"
+           "  --compare-full     also analyze whole tracks and report agreement with segment mode\n"
+           "  --split-minutes M  analyze files longer than M minutes in pieces on all threads, 0 = never (default: 20)\n"
+           "  --probe            only read duration and frequency from the headers, key/tempo from tags\n"
+           "  --use-tags         don't analyze files that already have key and BPM tags\n"
+           "  --metrics PATH     write counters and stage latencies to PATH (.json or Prometheus text)\n"
+           "  --metrics-interval S  seconds between metrics file updates (default: 5)\n"
+           "  --fft-wisdom PATH  load (or measure once and save) FFTW plans for key, tempo and centroid\n"
+           "  --resume           skip the files an interrupted run finished, append to its CSV\n"
+           "  --processes N      analyze in N worker processes, a crash or hang costs one file (default: 0 = threads)\n"
+           "  --timeout S        with --processes: give up on a file after S seconds, 0 = never (default: 600)\n"
+           "  --watch            then keep running and analyze files as they land in the folder (inotify)\n";
+}
+
+Options parseOptions(int argc, char **argv)
+{
+    Options o;
+    size_t cores = thread::hardware_concurrency();
+    o.threads = cores > 1 ? cores - 1 : 1;
+    o.queueDepth = 0;
+    o.errorPath = "bad.txt";
+    o.queueBytes = size_t(256) << 20;
+    o.mmap = true;
+    o.ioDepth = 32;
+    o.largestFirst = true;
+    o.cacheHash = false;
+    o.compareFull = false;
+    o.metricsInterval = 5;
+    o.processes = 0;
+    o.timeout = 600;
+    o.workerProcess = false;
+    o.resume = false;
+    o.watch = false;
+    bool cache = true;
+    o.scan.threads = 8;
+
+    vector<string> positional;
+    for (int i = 1; i < argc; ++i) {
+        string arg(argv[i]);
+        if (arg.size() < 2 || arg.compare(0, 2, "--") != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        if (arg == "--no-mmap") {
+            o.mmap = false;
+            continue;
+        }
+        if (arg == "--no-cache") {
+            cache = false;
+            continue;
+        }
+        if (arg == "--cache-hash") {
+            o.cacheHash = true;
+            continue;
+        }
+        if (arg == "--no-recursive") {
+            o.scan.recursive = false;
+            continue;
+        }
+        if (arg == "--probe") {
+            o.decode.probeOnly = true;
+            continue;
+        }
+        if (arg == "--use-tags") {
+            o.decode.useTags = true;
+            continue;
+        }
+        if (arg == "--compare-full") {
+            o.compareFull = true;
+            continue;
+        }
+        if (arg == "--resume") {
+            o.resume = true;
+            continue;
+        }
+        if (arg == "--watch") {
+            o.watch = true;
+            continue;
+        }
+        if (arg == "--worker-process") {
+            o.workerProcess = true;
+            continue;
+        }
+        if (arg == "--no-sniff") {
+            o.scan.sniff = false;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            throw invalid_argument("missing value for " + arg);
+        }
+        string value(argv[++i]);
+        if (arg == "--threads") {
+            o.threads = toNumber(arg, value);
+        } else if (arg == "--errors") {
+            o.errorPath = value;
+        } else if (arg == "--queue-depth") {
+            o.queueDepth = toNumber(arg, value);
+        } else if (arg == "--io-depth") {
+            o.ioDepth = toNumber(arg, value);
+            if (o.ioDepth == 0 || o.ioDepth > 4096) {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+        } else if (arg == "--queue-mb") {
+            o.queueBytes = toNumber(arg, value) << 20;
+        } else if (arg == "--order") {
+            if (value != "size" && value != "dir") {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+            o.largestFirst = value == "size";
+        } else if (arg == "--cache") {
+            o.cachePath = value;
+        } else if (arg == "--include") {
+            o.scan.include.push_back(value);
+        } else if (arg == "--exclude") {
+            o.scan.exclude.push_back(value);
+        } else if (arg == "--scan-threads") {
+            o.scan.threads = toNumber(arg, value);
+        } else if (arg == "--analysis-rate") {
+            size_t rate = toNumber(arg, value);
+            if (rate != 0 && (rate < 4000 || rate > 192000)) {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+            o.decode.analysisRate = unsigned(rate);
+        } else if (arg == "--split-minutes") {
+            o.decode.splitMinutes = unsigned(toNumber(arg, value));
+        } else if (arg == "--metrics") {
+            o.metricsPath = value;
+        } else if (arg == "--metrics-interval") {
+            o.metricsInterval = toNumber(arg, value);
+            if (o.metricsInterval == 0) {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+        } else if (arg == "--fft-wisdom") {
+            o.fftWisdom = value;
+        } else if (arg == "--processes") {
+            o.processes = toNumber(arg, value);
+        } else if (arg == "--timeout") {
+            o.timeout = toNumber(arg, value);
+        } else if (arg == "--segments") {
+            o.decode.segments = unsigned(toNumber(arg, value));
+        } else if (arg == "--segment-seconds") {
+            o.decode.segmentSeconds = double(toNumber(arg, value));
+            if (o.decode.segmentSeconds == 0) {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+        } else if (arg == "--analyzers") {
+            o.decode.analyzers.clear();
+            for (size_t start = 0, comma; start <= value.size(); start = comma + 1) {
+                comma = value.find(',', start);
+                if (comma == string::npos) {
+                    comma = value.size();
+                }
+                string name = value.substr(start, comma - start);
+                if (find(o.decode.analyzers.begin(), o.decode.analyzers.end(), name) != o.decode.analyzers.end()) {
+                    throw invalid_argument("analyzer " + name + " given twice");
+                }
+                o.decode.analyzers.push_back(name);
+            }
+            // throws for unknown names
+            analyzerColumns(o.decode.analyzers);
+        } else if (arg == "--channels") {
+            if (value != "mix" && value != "first") {
+                throw invalid_argument("bad value for " + arg + ": " + value);
+            }
+            o.decode.channels = value == "mix" ? ChannelMode::Mix : ChannelMode::First;
+        } else {
+            throw invalid_argument("unknown option " + arg);
+        }
+    }
+    if (positional.size() != 2) {
+        throw invalid_argument("Wrong number of params.");
+    }
+    if (o.processes > 0 && o.compareFull) {
+        // the comparison is collected in the analyzing process
+        throw invalid_argument("--compare-full can't be used with --processes");
+    }
+    if (o.watch && o.processes > 0) {
+        // worker processes are fed by the scan loop only
+        throw invalid_argument("--watch can't be used with --processes");
+    }
+    o.inputPath = positional[0];
+    o.csvPath = positional[1];
+    if (!cache) {
+        o.cachePath.clear();
+    } else if (o.cachePath.empty()) {
+        o.cachePath = o.csvPath + ".cache";
+    }
+    if (o.threads == 0) {
+        o.threads = 1;
+    }
+    if (o.queueDepth == 0) {
+        o.queueDepth = 2 * o.threads;
+    }
+    return o;
+}
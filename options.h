@@ -0,0 +1,64 @@
+#pragma once
+#include <string>
+#include <cstddef>
+#include "scanner.h"
+#include "decodeAudio.h"
+
+/**
+  Command line settings of one AudioAnalyzer run
+ *
+ */
+struct Options
+{
+    std::string inputPath;
+    std::string csvPath;
+    // files that could not be analyzed, with the reason
+    std::string errorPath;
+    // number of decode/analysis threads
+    size_t threads;
+    // max number of loaded files waiting for a free thread
+    size_t queueDepth;
+    // max bytes of loaded (compressed) audio held by the pipeline at once
+    size_t queueBytes;
+    // map input files instead of reading them into memory
+    bool mmap;
+    // without mmap: file reads kept in flight (io_uring or reader threads)
+    size_t ioDepth;
+    // submit files in order of decreasing size instead of directory order
+    bool largestFirst;
+    // results of earlier runs, empty = no cache
+    std::string cachePath;
+    // also match cache entries by file content (survives touch/rename)
+    bool cacheHash;
+    // which files of the folder are analyzed
+    ScanOptions scan;
+    // sample rate, channel downmix and segments the analysis runs on
+    DecodeOptions decode;
+    // analyze segment mode files a second time in full and report how well the results agree
+    bool compareFull;
+    // file the run's metrics are written to periodically, empty = none
+    std::string metricsPath;
+    size_t metricsInterval;     // seconds
+    // analyze in this many worker processes instead of threads, 0 = threads
+    size_t processes;
+    // seconds one file may take in a worker process, 0 = no limit
+    size_t timeout;
+    // FFTW wisdom file, measured on first use; empty = none
+    std::string fftWisdom;
+    // go on with the files an interrupted run didn't finish, appending to its CSV
+    bool resume;
+    // after the folder keep running and analyze files as they are written to it
+    bool watch;
+    // this is a worker process started by the supervisor (internal)
+    bool workerProcess;
+};
+
+/**
+  Parse command line:
+  AudioAnalyzer [options] <folder with audio files> <result CSV file path>
+  throws std::invalid_argument on bad input
+ *
+ */
+Options parseOptions(int argc, char **argv);
+
+std::string usage();
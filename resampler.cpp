@@ -0,0 +1,164 @@
+#include "resampler.h"
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// zero crossings on each side of the kernel and Kaiser window shape:
+// key and tempo analysis don't need more than ~60 dB stop band
+static const double zeroCrossings = 8;
+static const double kaiserBeta = 6;
+static const double rolloff = 0.92;
+
+// modified Bessel function of the first kind, order 0
+static double besselI0(double x)
+{
+    double sum = 1, term = 1;
+    for (int k = 1; k < 30; ++k) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+void Resampler::reset(unsigned in, unsigned outR)
+{
+    if (in == 0 || outR == 0) {
+        throw runtime_error("bad sample rate");
+    }
+    if (in != inRate || outR != outRate) {
+        inRate = in;
+        outRate = outR;
+        unsigned g = gcd(in, outR);
+        L = outR / g;
+        M = in / g;
+        phases = min(L, maxPhases);
+        coefs.clear();
+        half = taps = 0;
+        if (!passthrough()) {
+            // cutoff in cycles per input sample
+            double fc = 0.5 * min(1.0, double(L) / M) * rolloff;
+            half = size_t(ceil(zeroCrossings / (2 * fc)));
+            taps = (2 * half + 3) & ~size_t(3);
+            coefs.resize(size_t(phases) * taps);
+            double i0beta = besselI0(kaiserBeta);
+            for (unsigned p = 0; p < phases; ++p) {
+                float *h = &coefs[size_t(p) * taps];
+                double f = double(p) / phases;
+                double sum = 0;
+                for (size_t j = 0; j < taps; ++j) {
+                    // distance from the output instant to input sample j
+                    double x = f + double(half) - 1 - double(j);
+                    double w = fabs(x) / half;
+                    double v = 0;
+                    if (w < 1) {
+                        double sx = 2 * fc * x;
+                        v = 2 * fc * (sx == 0 ? 1 : sin(M_PI * sx) / (M_PI * sx)) *
+                            besselI0(kaiserBeta * sqrt(1 - w * w)) / i0beta;
+                    }
+                    h[j] = float(v);
+                    sum += v;
+                }
+                for (size_t j = 0; j < taps; ++j) {
+                    h[j] = float(h[j] / sum);   // unity gain at DC
+                }
+            }
+        }
+    }
+    // history before the first sample is silence; centre of the kernel on sample 0
+    size_t lead = half ? half - 1 : 0;
+    buf.assign(lead, 0.0f);
+    pos = 0;
+    frac = 0;
+    consumed = produced = 0;
+}
+
+float *Resampler::input(size_t n)
+{
+    if (passthrough()) {
+        buf.resize(n);
+        return buf.data();
+    }
+    // drop history no output can reach any more, in big steps
+    if (pos > 8192) {
+        buf.erase(buf.begin(), buf.begin() + pos);
+        pos = 0;
+    }
+    size_t len = buf.size();
+    buf.resize(len + n);
+    return buf.data() + len;
+}
+
+static inline float dot(const float *x, const float *h, size_t n)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(h + i + 4)));
+    }
+    if (i < n) {    // taps are a multiple of 4
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(h + i)));
+    }
+    acc0 = _mm_add_ps(acc0, acc1);
+    float r[4];
+    _mm_storeu_ps(r, acc0);
+    return (r[0] + r[1]) + (r[2] + r[3]);
+#else
+    float a[4] = {0, 0, 0, 0};
+    for (size_t i = 0; i < n; i += 4) {
+        for (int k = 0; k < 4; ++k) a[k] += x[i + k] * h[i + k];
+    }
+    return (a[0] + a[1]) + (a[2] + a[3]);
+#endif
+}
+
+void Resampler::produce(size_t available)
+{
+    const unsigned stepInt = M / L, stepFrac = M % L;
+    out.clear();
+    while (pos + taps <= available) {
+        unsigned phase = unsigned(uint64_t(frac) * phases / L);
+        out.push_back(dot(&buf[pos], &coefs[size_t(phase) * taps], taps));
+        pos += stepInt;
+        frac += stepFrac;
+        if (frac >= L) {
+            frac -= L;
+            ++pos;
+        }
+    }
+    produced += out.size();
+}
+
+pair<const float *, size_t> Resampler::process(size_t n)
+{
+    consumed += n;
+    if (passthrough()) {
+        produced += n;
+        return {buf.data(), n};
+    }
+    produce(buf.size());
+    return {out.data(), out.size()};
+}
+
+pair<const float *, size_t> Resampler::flush()
+{
+    if (passthrough()) {
+        return {nullptr, 0};
+    }
+    // output covering the whole input: ceil(consumed * L / M) samples
+    size_t expected = size_t((uint64_t(consumed) * L + M - 1) / M);
+    buf.resize(buf.size() + taps, 0.0f);
+    produce(buf.size());
+    if (produced > expected) {
+        out.resize(out.size() - min(out.size(), produced - expected));
+    }
+    return {out.data(), out.size()};
+}
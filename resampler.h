@@ -0,0 +1,43 @@
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+  Streaming windowed-sinc sample rate converter for mono float audio.
+  The ratio is kept exact as L/M (reduced out/in rates); the polyphase
+  coefficient table holds up to maxPhases phases, finer ratios use the
+  nearest phase. Input is written straight into the resampler's own
+  buffer (input()), so a converter/downmix kernel can feed it without
+  an intermediate copy.
+ *
+ */
+class Resampler
+{
+    static constexpr unsigned maxPhases = 1024;
+    unsigned inRate{0}, outRate{0};
+    unsigned L{1}, M{1};        // out/in rate ratio
+    unsigned phases{1};
+    size_t half{0};             // kernel half width in input samples
+    size_t taps{0};             // per phase, 2 * half rounded up to a multiple of 4
+    std::vector<float> coefs;   // phases x taps
+    std::vector<float> buf;     // pending input, buf[pos] is the first tap of the next output
+    size_t pos{0};
+    unsigned frac{0};           // fractional input position of the next output, in 1/L
+    std::vector<float> out;
+    size_t consumed{0}, produced{0};
+public:
+    // set rates and clear history; the table is only rebuilt if the rates changed
+    void reset(unsigned inRate, unsigned outRate);
+    bool passthrough() const { return L == M; }
+    unsigned inputRate() const { return inRate; }
+    unsigned outputRate() const { return outRate; }
+    // room for n input samples, valid until the next call
+    float *input(size_t n);
+    // resample the n samples written to input(); returns output valid until the next call
+    std::pair<const float *, size_t> process(size_t n);
+    // output still pending at the end of the stream
+    std::pair<const float *, size_t> flush();
+private:
+    void produce(size_t available);
+};
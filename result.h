@@ -0,0 +1,24 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// one CSV row: what the analysis found out about one file
+struct AnalysisResult
+{
+    std::string name;
+    int64_t duration;   // seconds
+    unsigned frequency;
+    // one per column of the enabled analyzers (analyzerColumns()), in the same order
+    std::vector<std::string> values;
+};
+
+inline std::ostream & operator<<(std::ostream &os, const AnalysisResult &r)
+{
+    os << r.name << "," << r.duration << "," << r.frequency;
+    for (auto &v : r.values) {
+        os << "," << v;
+    }
+    return os << "\n";
+}
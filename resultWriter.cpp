@@ -0,0 +1,220 @@
+#include "resultWriter.h"
+#include "metrics.h"
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// output is written once this much is buffered, or when the queue runs dry
+static const size_t batchBytes = 256 * 1024;
+// journal commits: each one costs a few fdatasyncs
+static const auto commitInterval = chrono::seconds(1);
+
+static const char *errorHeader = "File Name,Error\n";
+
+static uint64_t fileSize(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? uint64_t(st.st_size) : 0;
+}
+
+static string csvQuote(const string &s)
+{
+    if (s.find_first_of(",\"\n") == string::npos) {
+        return s;
+    }
+    string r = "\"";
+    for (char c : s) {
+        if (c == '"') r += '"';
+        r += c == '\n' ? ' ' : c;
+    }
+    return r + "\"";
+}
+
+ResultWriter::ResultWriter(const string &csvPath, const string &errorPath, const vector<string> &columns,
+                           AnalysisCache *cache, Journal *journal)
+    : csv(csvPath, journal && journal->resumed() ? ios::app : ios::trunc), errors(errorPath, ios::app),
+      cache(cache), journal(journal)
+{
+    if (!csv) {
+        throw runtime_error("can't open " + csvPath);
+    }
+    if (!errors) {
+        throw runtime_error("can't open " + errorPath);
+    }
+    string csvHeader = "File Name,Duration,Frequency";
+    for (auto &c : columns) {
+        csvHeader += "," + c;
+    }
+    csvBytes = fileSize(csvPath);
+    if (csvBytes == 0) {
+        csv << csvHeader << '\n' << flush;
+        csvBytes = csvHeader.size() + 1;
+    } else {
+        // rows of a resumed run must fit the columns of its header
+        ifstream in(csvPath);
+        string header;
+        if (!getline(in, header) || header != csvHeader) {
+            throw runtime_error(csvPath + " has other columns than the enabled analyzers, run without --resume");
+        }
+    }
+    errorBytes = fileSize(errorPath);
+    if (errorBytes == 0) {
+        errors << errorHeader << flush;
+        errorBytes = strlen(errorHeader);
+    }
+    if (journal) {
+        csvSync = open(csvPath.c_str(), O_RDONLY | O_CLOEXEC);
+        errorSync = open(errorPath.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    tail = new Item;    // stub node
+    head = tail;
+    thread = std::thread(&ResultWriter::run, this);
+}
+
+ResultWriter::~ResultWriter()
+{
+    close();
+    delete tail;
+    if (csvSync >= 0) {
+        ::close(csvSync);
+    }
+    if (errorSync >= 0) {
+        ::close(errorSync);
+    }
+}
+
+void ResultWriter::write(AnalysisResult result, CacheKey key)
+{
+    Item *item = new Item;
+    item->result = move(result);
+    item->key = move(key);
+    push(item);
+}
+
+void ResultWriter::error(string name, string message)
+{
+    Item *item = new Item;
+    item->result.name = move(name);
+    item->error = message.empty() ? "unknown error" : move(message);
+    push(item);
+}
+
+void ResultWriter::push(Item *item)
+{
+    Item *prev = head.exchange(item, memory_order_acq_rel);
+    // between the exchange and this store the item is invisible to pop()
+    prev->next.store(item, memory_order_release);
+}
+
+ResultWriter::Item *ResultWriter::pop()
+{
+    Item *next = tail->next.load(memory_order_acquire);
+    if (!next) {
+        return nullptr;
+    }
+    // next becomes the new stub; its payload is moved out by the caller
+    delete tail;
+    tail = next;
+    return next;
+}
+
+void ResultWriter::commit(string &entries)
+{
+    if (!journal || entries.empty()) {
+        return;
+    }
+    // the rows first: the journal must never list a file whose row could still be lost
+    if ((csvSync >= 0 && fdatasync(csvSync) != 0) || (errorSync >= 0 && fdatasync(errorSync) != 0)) {
+        cerr << "can't sync results: " << strerror(errno) << ", journal stopped" << endl;
+        journal = nullptr;
+        return;
+    }
+    try {
+        journal->commit(entries, csvBytes, errorBytes);
+    } catch (exception &e) {
+        cerr << e.what() << ", journal stopped" << endl;
+        journal = nullptr;
+    }
+    entries.clear();
+}
+
+void ResultWriter::run()
+{
+    string csvBatch, errorBatch, entries;
+    auto lastCommit = chrono::steady_clock::now();
+    auto flushBatches = [&] {
+        StageTimer timer(Stage::Write);
+        if (!csvBatch.empty()) {
+            csv.write(csvBatch.data(), csvBatch.size());
+            csv.flush();
+            csvBytes += csvBatch.size();
+            csvBatch.clear();
+        }
+        if (!errorBatch.empty()) {
+            errors.write(errorBatch.data(), errorBatch.size());
+            errors.flush();
+            errorBytes += errorBatch.size();
+            errorBatch.clear();
+        }
+        if (cache) {
+            cache->flush();
+        }
+    };
+    ostringstream row;
+    auto idle = chrono::microseconds(100);
+    for (;;) {
+        // read the flag first: after it is seen everything pushed before close() is poppable
+        bool last = stopping;
+        size_t n = 0;
+        while (Item *item = pop()) {
+            ++n;
+            if (journal) {
+                entries += Journal::entry(item->result.name, !item->error.empty());
+            }
+            if (item->error.empty()) {
+                row.str("");
+                row << item->result;
+                csvBatch += row.str();
+                if (cache && !item->key.path.empty()) {
+                    cache->store(item->key, item->result);
+                }
+            } else {
+                errorBatch += csvQuote(item->result.name) + "," + csvQuote(item->error) + "\n";
+            }
+            if (csvBatch.size() + errorBatch.size() >= batchBytes) {
+                flushBatches();
+            }
+        }
+        written += n;
+        Metrics::global().resultsWritten += n;
+        if (n) {
+            flushBatches();
+        }
+        if (last || chrono::steady_clock::now() - lastCommit >= commitInterval) {
+            commit(entries);
+            lastCommit = chrono::steady_clock::now();
+        }
+        if (last) {
+            break;
+        }
+        // nothing to do: back off up to 20 ms, a file takes much longer to analyze
+        idle = n ? chrono::microseconds(100) : min(idle * 2, chrono::microseconds(20000));
+        this_thread::sleep_for(idle);
+    }
+}
+
+void ResultWriter::close()
+{
+    if (thread.joinable()) {
+        stopping = true;
+        thread.join();
+    }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "result.h"
+#include "analysisCache.h"
+#include "journal.h"
+
+/**
+  Single writer thread for the CSV, the error file and the cache.
+  Workers hand their results over through a lock-free multi-producer
+  queue and never block on I/O; the writer drains it in batches and
+  writes them with few large writes.
+  With a journal, the rows are synced to disk about once a second and
+  then committed to the journal.
+ *
+ */
+class ResultWriter
+{
+    struct Item {
+        AnalysisResult result;
+        CacheKey key;          // key.path empty = not cached
+        std::string error;     // not empty = analysis failed
+        std::atomic<Item *> next{nullptr};
+    };
+
+    std::ofstream csv;
+    std::ofstream errors;
+    AnalysisCache *cache;
+    Journal *journal;
+    // for fdatasync: the streams don't expose theirs
+    int csvSync{-1};
+    int errorSync{-1};
+    uint64_t csvBytes{0};
+    uint64_t errorBytes{0};
+    // Vyukov MPSC queue: producers swap themselves into head, the writer owns tail
+    std::atomic<Item *> head;
+    Item *tail;
+    std::atomic_bool stopping{false};
+    std::atomic<size_t> written{0};
+    std::thread thread;
+public:
+    // the CSV is started over unless the journal resumed an earlier run;
+    // the error file is always appended to. columns - of the enabled analyzers
+    ResultWriter(const std::string &csvPath, const std::string &errorPath, const std::vector<std::string> &columns,
+                 AnalysisCache *cache, Journal *journal = nullptr);
+    ResultWriter(const ResultWriter &) = delete;
+    ResultWriter & operator=(const ResultWriter &) = delete;
+    ~ResultWriter();
+
+    void write(AnalysisResult result, CacheKey key = {});
+    void error(std::string name, std::string message);
+    // write everything queued so far and stop the writer thread
+    void close();
+    // results and errors written so far
+    size_t count() const { return written; }
+private:
+    void push(Item *item);
+    Item *pop();
+    void run();
+    // sync the rows written so far and commit their files to the journal
+    void commit(std::string &entries);
+};
@@ -0,0 +1,376 @@
+#include "sampleConvert.h"
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86 1
+#endif
+
+using namespace std;
+
+// factor bringing each sample type to [-1, 1]
+template <class T> static constexpr float fullScale();
+template <> constexpr float fullScale<uint8_t>() { return 1.0f / 128; }
+template <> constexpr float fullScale<int16_t>() { return 1.0f / 32768; }
+template <> constexpr float fullScale<int32_t>() { return 1.0f / 2147483648.0f; }
+template <> constexpr float fullScale<int64_t>() { return 1.0f / 9223372036854775808.0f; }
+template <> constexpr float fullScale<float>() { return 1.0f; }
+template <> constexpr float fullScale<double>() { return 1.0f; }
+
+// unsigned 8 bit samples are centered at 128
+template <class T> static inline float value(T v) { return float(v); }
+static inline float value(uint8_t v) { return float(int(v) - 128); }
+
+/**
+  Plain C++ kernels: the reference and the fallback for everything
+  the SIMD versions don't cover
+ *
+ */
+struct ScalarOps {
+    // out[i] (+)= src[i] * scale
+    template <class T>
+    static void plane(const T *src, size_t n, float *out, float scale, bool accumulate) {
+        if (accumulate) {
+            for (size_t i = 0; i < n; ++i) out[i] += value(src[i]) * scale;
+        } else {
+            for (size_t i = 0; i < n; ++i) out[i] = value(src[i]) * scale;
+        }
+    }
+    // out[i] = (left + right) * scale, interleaved stereo
+    template <class T>
+    static void stereo(const T *src, size_t n, float *out, float scale) {
+        for (size_t i = 0; i < n; ++i) out[i] = (value(src[2 * i]) + value(src[2 * i + 1])) * scale;
+    }
+};
+
+#ifdef SAMPLE_CONVERT_X86
+
+// SSE2 is part of x86-64, no run time check needed
+struct Sse2Ops : ScalarOps {
+    using ScalarOps::plane;
+    using ScalarOps::stereo;
+
+    static inline void put(float *out, __m128 v, bool accumulate) {
+        _mm_storeu_ps(out, accumulate ? _mm_add_ps(_mm_loadu_ps(out), v) : v);
+    }
+    static inline void putS16(const __m128i v, float *out, __m128 s, bool accumulate) {
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        put(out, _mm_mul_ps(_mm_cvtepi32_ps(lo), s), accumulate);
+        put(out + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), s), accumulate);
+    }
+
+    static void plane(const int16_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            putS16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)), out + i, s, accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    static void plane(const uint8_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m128 s = _mm_set1_ps(scale);
+        __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            putS16(_mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias), out + i, s, accumulate);
+            putS16(_mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias), out + i + 8, s, accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    static void plane(const int32_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            put(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    static void plane(const float *src, size_t n, float *out, float scale, bool accumulate) {
+        if (scale == 1.0f && !accumulate) {
+            memcpy(out, src, n * sizeof(float));
+            return;
+        }
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            put(out + i, _mm_mul_ps(_mm_loadu_ps(src + i), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    static void plane(const double *src, size_t n, float *out, float scale, bool accumulate) {
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128 v = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(src + i)), _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2)));
+            put(out + i, _mm_mul_ps(v, s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+
+    static void stereo(const int16_t *src, size_t n, float *out, float scale) {
+        __m128 s = _mm_set1_ps(scale);
+        __m128i ones = _mm_set1_epi16(1);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            // madd sums each left/right pair into one 32 bit lane
+            __m128i v = _mm_madd_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i)), ones);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), s));
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+    static inline void stereoPs(__m128 a, __m128 b, float *out, __m128 s) {
+        __m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out, _mm_mul_ps(_mm_add_ps(left, right), s));
+    }
+    static void stereo(const float *src, size_t n, float *out, float scale) {
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            stereoPs(_mm_loadu_ps(src + 2 * i), _mm_loadu_ps(src + 2 * i + 4), out + i, s);
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+    static void stereo(const int32_t *src, size_t n, float *out, float scale) {
+        __m128 s = _mm_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128 a = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i)));
+            __m128 b = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i + 4)));
+            stereoPs(a, b, out + i, s);
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+};
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+struct Avx2Ops : ScalarOps {
+    using ScalarOps::plane;
+    using ScalarOps::stereo;
+
+    TARGET_AVX2 static inline void put(float *out, __m256 v, bool accumulate) {
+        _mm256_storeu_ps(out, accumulate ? _mm256_add_ps(_mm256_loadu_ps(out), v) : v);
+    }
+
+    TARGET_AVX2 static void plane(const int16_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+            put(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    TARGET_AVX2 static void plane(const uint8_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m256 s = _mm256_set1_ps(scale);
+        __m256i bias = _mm256_set1_epi32(128);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i)));
+            put(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(v, bias)), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    TARGET_AVX2 static void plane(const int32_t *src, size_t n, float *out, float scale, bool accumulate) {
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+            put(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    TARGET_AVX2 static void plane(const float *src, size_t n, float *out, float scale, bool accumulate) {
+        if (scale == 1.0f && !accumulate) {
+            memcpy(out, src, n * sizeof(float));
+            return;
+        }
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            put(out + i, _mm256_mul_ps(_mm256_loadu_ps(src + i), s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+    TARGET_AVX2 static void plane(const double *src, size_t n, float *out, float scale, bool accumulate) {
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 v = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(src + i + 4)),
+                                       _mm256_cvtpd_ps(_mm256_loadu_pd(src + i)));
+            put(out + i, _mm256_mul_ps(v, s), accumulate);
+        }
+        ScalarOps::plane(src + i, n - i, out + i, scale, accumulate);
+    }
+
+    TARGET_AVX2 static void stereo(const int16_t *src, size_t n, float *out, float scale) {
+        __m256 s = _mm256_set1_ps(scale);
+        __m256i ones = _mm256_set1_epi16(1);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i v = _mm256_madd_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i)), ones);
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), s));
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+    TARGET_AVX2 static inline void stereoPs(__m256 a, __m256 b, float *out, __m256 s) {
+        // in-lane shuffles leave 64 bit pairs as a0 b0 a1 b1, permute puts them in order
+        __m256 left = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 right = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        __m256 sum = _mm256_add_ps(left, right);
+        sum = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sum), _MM_SHUFFLE(3, 1, 2, 0)));
+        _mm256_storeu_ps(out, _mm256_mul_ps(sum, s));
+    }
+    TARGET_AVX2 static void stereo(const float *src, size_t n, float *out, float scale) {
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            stereoPs(_mm256_loadu_ps(src + 2 * i), _mm256_loadu_ps(src + 2 * i + 8), out + i, s);
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+    TARGET_AVX2 static void stereo(const int32_t *src, size_t n, float *out, float scale) {
+        __m256 s = _mm256_set1_ps(scale);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 a = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i)));
+            __m256 b = _mm256_cvtepi32_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * i + 8)));
+            stereoPs(a, b, out + i, s);
+        }
+        ScalarOps::stereo(src + 2 * i, n - i, out + i, scale);
+    }
+};
+
+#endif
+
+// planar, or interleaved mono: the wanted channel is contiguous
+template <class Ops, class T>
+static void planarFirst(const uint8_t *const *data, unsigned, size_t frames, float *out)
+{
+    Ops::plane(reinterpret_cast<const T *>(data[0]), frames, out, fullScale<T>(), false);
+}
+
+template <class Ops, class T>
+static void planarMix(const uint8_t *const *data, unsigned channels, size_t frames, float *out)
+{
+    float scale = fullScale<T>() / channels;
+    for (unsigned c = 0; c < channels; ++c) {
+        Ops::plane(reinterpret_cast<const T *>(data[c]), frames, out, scale, c > 0);
+    }
+}
+
+template <class Ops, class T>
+static void stereoMix(const uint8_t *const *data, unsigned, size_t frames, float *out)
+{
+    Ops::stereo(reinterpret_cast<const T *>(data[0]), frames, out, fullScale<T>() / 2);
+}
+
+// strided access doesn't vectorize well, these stay scalar
+template <class T>
+static void interleavedFirst(const uint8_t *const *data, unsigned channels, size_t frames, float *out)
+{
+    const T *src = reinterpret_cast<const T *>(data[0]);
+    for (size_t i = 0; i < frames; ++i) out[i] = value(src[i * channels]) * fullScale<T>();
+}
+
+template <class T>
+static void interleavedMix(const uint8_t *const *data, unsigned channels, size_t frames, float *out)
+{
+    const T *src = reinterpret_cast<const T *>(data[0]);
+    float scale = fullScale<T>() / channels;
+    for (size_t i = 0; i < frames; ++i, src += channels) {
+        float sum = 0;
+        for (unsigned c = 0; c < channels; ++c) sum += value(src[c]);
+        out[i] = sum * scale;
+    }
+}
+
+// interleaved samples of every channel: one plane of frames * channels
+template <class Ops, class T>
+static void interleavedAll(const uint8_t *const *data, unsigned channels, size_t frames, float *out)
+{
+    Ops::plane(reinterpret_cast<const T *>(data[0]), frames * channels, out, fullScale<T>(), false);
+}
+
+template <class T>
+static void planarAll(const uint8_t *const *data, unsigned channels, size_t frames, float *out)
+{
+    for (unsigned c = 0; c < channels; ++c) {
+        const T *src = reinterpret_cast<const T *>(data[c]);
+        for (size_t i = 0; i < frames; ++i) out[i * channels + c] = value(src[i]) * fullScale<T>();
+    }
+}
+
+template <class Ops, class T>
+static ConvertFn select(bool planar, unsigned channels, ChannelMode mode)
+{
+    if (mode == ChannelMode::All) {
+        return planar && channels > 1 ? planarAll<T> : interleavedAll<Ops, T>;
+    }
+    if (planar || channels == 1) {
+        return mode == ChannelMode::Mix && channels > 1 ? planarMix<Ops, T> : planarFirst<Ops, T>;
+    }
+    if (mode == ChannelMode::First) {
+        return interleavedFirst<T>;
+    }
+    return channels == 2 ? stereoMix<Ops, T> : interleavedMix<T>;
+}
+
+template <class Ops>
+static ConvertFn select(SampleType type, bool planar, unsigned channels, ChannelMode mode)
+{
+    switch (type) {
+    case SampleType::U8:  return select<Ops, uint8_t>(planar, channels, mode);
+    case SampleType::S16: return select<Ops, int16_t>(planar, channels, mode);
+    case SampleType::S32: return select<Ops, int32_t>(planar, channels, mode);
+    case SampleType::S64: return select<Ops, int64_t>(planar, channels, mode);
+    case SampleType::FLT: return select<Ops, float>(planar, channels, mode);
+    case SampleType::DBL: return select<Ops, double>(planar, channels, mode);
+    }
+    throw runtime_error("Sample format not supported");
+}
+
+ConvertFn selectConverter(SampleType type, bool planar, unsigned channels, ChannelMode mode, Isa isa)
+{
+    if (channels == 0) {
+        throw runtime_error("no audio channels");
+    }
+#ifdef SAMPLE_CONVERT_X86
+    if (isa == Isa::AVX2 && bestIsa() == Isa::AVX2) {
+        return select<Avx2Ops>(type, planar, channels, mode);
+    }
+    if (isa != Isa::Scalar) {
+        return select<Sse2Ops>(type, planar, channels, mode);
+    }
+#endif
+    return select<ScalarOps>(type, planar, channels, mode);
+}
+
+ConvertFn selectConverter(SampleType type, bool planar, unsigned channels, ChannelMode mode)
+{
+    return selectConverter(type, planar, channels, mode, bestIsa());
+}
+
+Isa bestIsa()
+{
+#ifdef SAMPLE_CONVERT_X86
+    static const Isa isa = __builtin_cpu_supports("avx2") ? Isa::AVX2 : Isa::SSE2;
+    return isa;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+const char *isaName(Isa isa)
+{
+    switch (isa) {
+    case Isa::AVX2: return "avx2";
+    case Isa::SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
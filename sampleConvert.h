@@ -0,0 +1,33 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// sample types decoders produce (FFmpeg's AVSampleFormat without the planar flag)
+enum class SampleType { U8, S16, S32, S64, FLT, DBL };
+
+// how channels are reduced to one; All keeps every channel, interleaved
+enum class ChannelMode { First, Mix, All };
+
+// instruction sets the conversion kernels are built for
+enum class Isa { Scalar, SSE2, AVX2 };
+
+/**
+  Convert frames of decoded audio to mono float 32 bit samples in [-1, 1]
+  (frames * channels interleaved samples with ChannelMode::All).
+  data - one pointer per channel for planar formats,
+         data[0] with interleaved samples otherwise
+ *
+ */
+typedef void (*ConvertFn)(const uint8_t *const *data, unsigned channels, size_t frames, float *out);
+
+/**
+  Pick the kernel for one stream; call once per stream, not per sample.
+  isa - fastest the CPU supports by default
+ *
+ */
+ConvertFn selectConverter(SampleType type, bool planar, unsigned channels, ChannelMode mode, Isa isa);
+ConvertFn selectConverter(SampleType type, bool planar, unsigned channels, ChannelMode mode);
+
+// fastest instruction set of this CPU (checked once at run time)
+Isa bestIsa();
+const char *isaName(Isa isa);
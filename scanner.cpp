@@ -0,0 +1,333 @@
+#include "scanner.h"
+#include "archive.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// extensions ffmpeg is trusted with even if the signature is not recognized
+// (e.g. mp3 with garbage before the first frame)
+static const char *audioExtensions[] = {
+    "mp3", "mp2", "flac", "wav", "ogg", "oga", "opus", "m4a", "mp4", "aac", "wma",
+    "aif", "aiff", "ape", "wv", "mpc", "mka", "webm", "ac3", "dts", "alac", "tta", "caf", "dsf", "dff",
+};
+
+static bool startsWith(const uint8_t *p, size_t size, const char *magic, size_t offset = 0)
+{
+    size_t n = strlen(magic);
+    return size >= offset + n && memcmp(p + offset, magic, n) == 0;
+}
+
+bool looksLikeAudio(const uint8_t *p, size_t size)
+{
+    if (size < 4) {
+        return false;
+    }
+    if (startsWith(p, size, "ID3") || startsWith(p, size, "fLaC") || startsWith(p, size, "OggS") ||
+        startsWith(p, size, "MAC ") || startsWith(p, size, "wvpk") || startsWith(p, size, "MPCK") ||
+        startsWith(p, size, "MP+") || startsWith(p, size, "caff") || startsWith(p, size, ".snd") ||
+        startsWith(p, size, "TTA1") || startsWith(p, size, "OFR ") || startsWith(p, size, "DSD ") ||
+        startsWith(p, size, "FRM8") || startsWith(p, size, "#!AMR") || startsWith(p, size, "ftyp", 4)) {
+        return true;
+    }
+    if ((startsWith(p, size, "RIFF") || startsWith(p, size, "RF64")) && startsWith(p, size, "WAVE", 8)) {
+        return true;
+    }
+    if (startsWith(p, size, "FORM") && (startsWith(p, size, "AIFF", 8) || startsWith(p, size, "AIFC", 8))) {
+        return true;
+    }
+    static const uint8_t asf[] = {0x30, 0x26, 0xB2, 0x75};       // wma
+    static const uint8_t ebml[] = {0x1A, 0x45, 0xDF, 0xA3};      // mka, webm
+    if (memcmp(p, asf, 4) == 0 || memcmp(p, ebml, 4) == 0) {
+        return true;
+    }
+    if (p[0] == 0x0B && p[1] == 0x77) {     // ac3
+        return true;
+    }
+    // mpeg audio / adts aac frame sync
+    return p[0] == 0xFF && (p[1] & 0xE0) == 0xE0;
+}
+
+static bool hasAudioExtension(const string &name)
+{
+    auto dot = name.rfind('.');
+    if (dot == string::npos) {
+        return false;
+    }
+    string ext = name.substr(dot + 1);
+    transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return tolower(c); });
+    return any_of(begin(audioExtensions), end(audioExtensions), [&](const char *e) { return ext == e; });
+}
+
+static bool matchesAny(const vector<string> &patterns, const string &relPath)
+{
+    int flags = 0;
+#ifdef FNM_CASEFOLD
+    flags |= FNM_CASEFOLD;
+#endif
+    return any_of(patterns.begin(), patterns.end(),
+                  [&](const string &p) { return fnmatch(p.c_str(), relPath.c_str(), flags) == 0; });
+}
+
+static string withoutExtension(const string &relPath)
+{
+    auto dot = relPath.rfind('.');
+    auto slash = relPath.rfind('/');
+    bool hasExt = dot != string::npos && (slash == string::npos || dot > slash + 1);
+    return hasExt ? relPath.substr(0, dot) : relPath;
+}
+
+// size and (if sniff) signature check, false = not an audio file; err set if it couldn't be read
+static bool inspectFile(int dir, const string &name, bool sniff, ScannedFile &f, int &err)
+{
+    bool trustExtension = hasAudioExtension(name);
+    if (!sniff) {
+        struct stat st;
+        if (fstatat(dir, name.c_str(), &st, 0) != 0) {
+            err = errno;
+            return false;
+        }
+        f.size = uint64_t(st.st_size);
+        return true;
+    }
+    int fd = openat(dir, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        err = errno;
+        return false;
+    }
+    struct stat st;
+    uint8_t head[16];
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0) {
+        n = pread(fd, head, sizeof head, 0);
+    }
+    if (n < 0) {
+        err = errno;
+    }
+    close(fd);
+    f.size = uint64_t(st.st_size);
+    return n > 0 && (looksLikeAudio(head, size_t(n)) || trustExtension);
+}
+
+namespace {
+
+/**
+  Directories waiting to be listed, shared by the scan threads;
+  the walk is over when nothing is queued and no thread is listing
+ *
+ */
+class DirQueue
+{
+    deque<string> dirs;     // relative to the root
+    size_t busy{0};
+    mutex m;
+    condition_variable cv;
+public:
+    void push(string dir) {
+        {
+            lock_guard<mutex> l(m);
+            dirs.push_back(move(dir));
+        }
+        cv.notify_one();
+    }
+    bool pop(string &dir) {
+        unique_lock<mutex> l(m);
+        cv.wait(l, [&] { return !dirs.empty() || busy == 0; });
+        if (dirs.empty()) {
+            return false;
+        }
+        dir = move(dirs.front());
+        dirs.pop_front();
+        ++busy;
+        return true;
+    }
+    void finished() {
+        {
+            lock_guard<mutex> l(m);
+            --busy;
+        }
+        cv.notify_all();
+    }
+};
+
+class Scanner
+{
+    const string root;
+    const ScanOptions &options;
+    DirQueue queue;
+    mutex m;
+    ScanResult result;
+public:
+    Scanner(const string &root, const ScanOptions &options) : root(root), options(options) {}
+
+    ScanResult run() {
+        DIR *d = opendir(root.c_str());
+        if (!d) {
+            throw runtime_error("can't open folder " + root + ": " + strerror(errno));
+        }
+        closedir(d);
+        queue.push("");
+        vector<thread> threads;
+        for (size_t i = 0; i < max<size_t>(options.threads, 1); ++i) {
+            threads.emplace_back([this] {
+                string dir;
+                while (queue.pop(dir)) {
+                    listDir(dir);
+                    queue.finished();
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        sort(result.files.begin(), result.files.end(),
+             [](const ScannedFile &a, const ScannedFile &b) { return a.path < b.path; });
+        return move(result);
+    }
+
+private:
+    void error(const string &what) {
+        lock_guard<mutex> l(m);
+        result.errors.push_back(what + ": " + strerror(errno));
+    }
+
+    void listDir(const string &rel) {
+        string dirPath = rel.empty() ? root : root + "/" + rel;
+        DIR *d = opendir(dirPath.c_str());
+        if (!d) {
+            error(dirPath);
+            return;
+        }
+        vector<ScannedFile> found;
+        size_t rejected = 0;
+        while (dirent *e = readdir(d)) {
+            string name(e->d_name);
+            if (name == "." || name == "..") {
+                continue;
+            }
+            string relPath = rel.empty() ? name : rel + "/" + name;
+            unsigned char type = e->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK) {
+                struct stat st;
+                if (fstatat(dirfd(d), name.c_str(), &st, 0) != 0) {
+                    error(root + "/" + relPath);
+                    continue;
+                }
+                // symlinked folders are not followed: they could form a loop
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && type == DT_UNKNOWN ? DT_DIR : DT_UNKNOWN;
+            }
+            if (type == DT_DIR) {
+                if (options.recursive) {
+                    queue.push(relPath);
+                }
+                continue;
+            }
+            if (type != DT_REG) {
+                continue;
+            }
+            if ((!options.include.empty() && !matchesAny(options.include, relPath)) ||
+                matchesAny(options.exclude, relPath)) {
+                ++rejected;
+                continue;
+            }
+            ScannedFile f;
+            f.path = root + "/" + relPath;
+            if (!inspect(dirfd(d), name, f)) {
+                ++rejected;
+                continue;
+            }
+            f.name = withoutExtension(relPath);
+            found.push_back(move(f));
+        }
+        closedir(d);
+
+        lock_guard<mutex> l(m);
+        result.rejected += rejected;
+        move(found.begin(), found.end(), back_inserter(result.files));
+    }
+
+    // size and (if enabled) signature check, false = not an audio file
+    bool inspect(int dir, const string &name, ScannedFile &f) {
+        int err = 0;
+        bool audio = inspectFile(dir, name, options.sniff, f, err);
+        if (err) {
+            errno = err;
+            error(f.path);
+        }
+        return audio;
+    }
+};
+
+}
+
+ScanResult scanFolder(const string &folder, const ScanOptions &options)
+{
+    string root = folder;
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    return Scanner(root, options).run();
+}
+
+bool scanFile(const string &folder, const string &relPath, const ScanOptions &options, ScannedFile &file)
+{
+    if ((!options.include.empty() && !matchesAny(options.include, relPath)) || matchesAny(options.exclude, relPath)) {
+        return false;
+    }
+    string root = folder;
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    file.path = root + "/" + relPath;
+    file.name = withoutExtension(relPath);
+    int err = 0;
+    return inspectFile(AT_FDCWD, file.path, options.sniff, file, err);
+}
+
+ScanResult scanArchive(const Archive &archive, const ScanOptions &options)
+{
+    ScanResult result;
+    auto &members = archive.members();
+    for (size_t i = 0; i < members.size(); ++i) {
+        const string &relPath = members[i].name;
+        if ((!options.recursive && relPath.find('/') != string::npos) ||
+            (!options.include.empty() && !matchesAny(options.include, relPath)) ||
+            matchesAny(options.exclude, relPath)) {
+            ++result.rejected;
+            continue;
+        }
+        if (members[i].compression == ArchiveMember::Compression::Unsupported) {
+            result.errors.push_back(archive.path() + ":" + relPath + ": " + members[i].problem);
+            continue;
+        }
+        if (options.sniff && !hasAudioExtension(relPath)) {
+            uint8_t head[16];
+            size_t n = archive.peek(i, head, sizeof head);
+            if (!looksLikeAudio(head, n)) {
+                ++result.rejected;
+                continue;
+            }
+        }
+        ScannedFile f;
+        f.path = archive.path() + ":" + relPath;
+        f.name = withoutExtension(relPath);
+        f.size = members[i].size;
+        f.member = i;
+        result.files.push_back(move(f));
+    }
+    sort(result.files.begin(), result.files.end(),
+         [](const ScannedFile &a, const ScannedFile &b) { return a.path < b.path; });
+    return result;
+}
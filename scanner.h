@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ScanOptions
+{
+    bool recursive{true};
+    // glob patterns (fnmatch) matched against the path relative to the scanned folder
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    // check the first bytes of each file for a known audio container signature
+    bool sniff{true};
+    size_t threads{1};
+};
+
+struct ScannedFile
+{
+    std::string path;       // full path, archive:member for archive input
+    std::string name;       // relative to the scanned folder or archive, without extension
+    uint64_t size;
+    size_t member{0};       // index in Archive::members()
+};
+
+struct ScanResult
+{
+    std::vector<ScannedFile> files;     // sorted by path
+    size_t rejected{0};                 // filtered out by globs or signature
+    std::vector<std::string> errors;    // unreadable folders and files
+};
+
+/**
+  List audio files under folder, walking sub folders in parallel.
+  Files are rejected by glob and by signature before anything else is done with them,
+  throws std::runtime_error if folder itself can't be read
+ *
+ */
+ScanResult scanFolder(const std::string &folder, const ScanOptions &options);
+
+// one file of the folder, relPath relative to it: false if it is rejected or can't be read
+bool scanFile(const std::string &folder, const std::string &relPath, const ScanOptions &options, ScannedFile &file);
+
+class Archive;
+
+// the same for the members of a tar or zip archive; member names are matched by the globs
+ScanResult scanArchive(const Archive &archive, const ScanOptions &options);
+
+// true if the first bytes of a file look like an audio container or stream ffmpeg can decode
+bool looksLikeAudio(const uint8_t *head, size_t size);
@@ -0,0 +1,307 @@
+#include "supervisor.h"
+#include "worker.h"
+#include "metrics.h"
+#include "archive.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// pipe ends of a worker process
+static const int requestFd = 3;
+static const int replyFd = 4;
+
+static bool writeAll(int fd, const char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= size_t(w);
+    }
+    return true;
+}
+
+static bool readAll(int fd, char *p, size_t n)
+{
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        p += r;
+        n -= size_t(r);
+    }
+    return true;
+}
+
+// message on a pipe: number of fields, then length and bytes of each field
+static bool writeMessage(int fd, const vector<string> &fields)
+{
+    string buf;
+    auto put = [&](uint32_t v) { buf.append(reinterpret_cast<const char *>(&v), sizeof v); };
+    put(uint32_t(fields.size()));
+    for (auto &f : fields) {
+        put(uint32_t(f.size()));
+        buf += f;
+    }
+    return writeAll(fd, buf.data(), buf.size());
+}
+
+static bool readMessage(int fd, vector<string> &fields)
+{
+    uint32_t count;
+    if (!readAll(fd, reinterpret_cast<char *>(&count), sizeof count) || count > 64) {
+        return false;
+    }
+    fields.resize(count);
+    for (auto &f : fields) {
+        uint32_t n;
+        if (!readAll(fd, reinterpret_cast<char *>(&n), sizeof n) || n > (1u << 20)) {
+            return false;
+        }
+        f.resize(n);
+        if (n > 0 && !readAll(fd, &f[0], n)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Supervisor::Supervisor(int argc, char **argv, size_t processCount, chrono::seconds timeout, ResultWriter &writer)
+    : timeout(timeout), writer(writer), processes(processCount ? processCount : 1)
+{
+    // a worker that died must not take the supervisor with it on the next write
+    signal(SIGPIPE, SIG_IGN);
+    args.assign(argv, argv + argc);
+    args.push_back("--worker-process");
+    for (auto &p : processes) {
+        start(p);
+    }
+}
+
+Supervisor::~Supervisor()
+{
+    for (auto &p : processes) {
+        stop(p);
+    }
+}
+
+void Supervisor::start(Process &p)
+{
+    int req[2], rep[2];
+    if (pipe2(req, O_CLOEXEC) != 0) {
+        throw runtime_error(string("can't create pipe: ") + strerror(errno));
+    }
+    if (pipe2(rep, O_CLOEXEC) != 0) {
+        int err = errno;
+        close(req[0]);
+        close(req[1]);
+        throw runtime_error(string("can't create pipe: ") + strerror(err));
+    }
+    vector<char *> argv;
+    for (auto &a : args) {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only async-signal-safe calls until exec: the parent has other threads.
+        // Move the pipe ends out of the way first, one of them may be fd 3 or 4
+        int in = fcntl(req[0], F_DUPFD_CLOEXEC, 10);
+        int out = fcntl(rep[1], F_DUPFD_CLOEXEC, 10);
+        if (in < 0 || out < 0 || dup2(in, requestFd) < 0 || dup2(out, replyFd) < 0) {
+            _exit(127);
+        }
+        execv("/proc/self/exe", argv.data());
+        _exit(127);
+    }
+    int err = errno;
+    close(req[0]);
+    close(rep[1]);
+    if (pid < 0) {
+        close(req[1]);
+        close(rep[0]);
+        throw runtime_error(string("can't start worker process: ") + strerror(err));
+    }
+    p.pid = pid;
+    p.request = req[1];
+    p.reply = rep[0];
+    p.busy = false;
+}
+
+void Supervisor::stop(Process &p)
+{
+    if (p.pid <= 0) {
+        return;
+    }
+    if (p.busy) {
+        kill(p.pid, SIGKILL);
+    }
+    // an idle worker exits when its request pipe closes
+    close(p.request);
+    close(p.reply);
+    int status;
+    while (waitpid(p.pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    p = Process();
+}
+
+void Supervisor::submit(string path, string name, CacheKey key, uint64_t size)
+{
+    Metrics::global().bytesRead += size;
+    File file{move(path), move(name), move(key), size};
+    for (;;) {
+        auto idle = find_if(processes.begin(), processes.end(), [](const Process &p) { return !p.busy; });
+        if (idle != processes.end()) {
+            send(*idle, move(file));
+            return;
+        }
+        serve();
+    }
+}
+
+void Supervisor::finish()
+{
+    while (serve()) {
+    }
+}
+
+void Supervisor::send(Process &p, File file)
+{
+    p.busy = true;
+    p.deadline = Clock::now() + timeout;
+    p.file = move(file);
+    ++Metrics::global().tasksRunning;
+    if (!writeMessage(p.request, {p.file.path, p.file.name})) {
+        fail(p, false);
+    }
+}
+
+bool Supervisor::serve()
+{
+    vector<pollfd> fds;
+    vector<Process *> busy;
+    auto now = Clock::now();
+    int wait = -1;
+    for (auto &p : processes) {
+        if (!p.busy) {
+            continue;
+        }
+        fds.push_back({p.reply, POLLIN, 0});
+        busy.push_back(&p);
+        if (timeout.count() > 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(p.deadline - now).count() + 1;
+            int ms = int(max<int64_t>(left, 0));
+            wait = wait < 0 ? ms : min(wait, ms);
+        }
+    }
+    if (fds.empty()) {
+        return false;
+    }
+    if (poll(fds.data(), fds.size(), wait) < 0 && errno != EINTR) {
+        throw runtime_error(string("poll failed: ") + strerror(errno));
+    }
+    now = Clock::now();
+    for (size_t i = 0; i < fds.size(); ++i) {
+        if (fds[i].revents) {
+            receive(*busy[i]);
+        } else if (timeout.count() > 0 && now >= busy[i]->deadline) {
+            fail(*busy[i], true);
+        }
+    }
+    return true;
+}
+
+void Supervisor::receive(Process &p)
+{
+    vector<string> reply;
+    if (!readMessage(p.reply, reply) || reply.empty()) {
+        fail(p, false);
+        return;
+    }
+    File file = move(p.file);
+    p.busy = false;
+    ++done_;
+    Metrics &metrics = Metrics::global();
+    --metrics.tasksRunning;
+    if (reply[0] == "ok" && reply.size() >= 4) {
+        // then the values of the analyzers' columns
+        AnalysisResult r{file.name, stoll(reply[1]), unsigned(stoul(reply[2])),
+                         vector<string>(reply.begin() + 4, reply.end())};
+        ++metrics.filesAnalyzed;
+        metrics.audioMicroseconds += uint64_t(max<int64_t>(r.duration, 0)) * 1000000;
+        writer.write(move(r), reply[3] == "1" ? move(file.key) : CacheKey{});
+    } else {
+        ++metrics.filesFailed;
+        writer.error(file.name, reply.size() > 1 ? reply[1] : "bad reply from worker process");
+    }
+}
+
+void Supervisor::fail(Process &p, bool timedOut)
+{
+    File file = move(p.file);
+    // no-op if it died, a worker sending garbage goes too
+    kill(p.pid, SIGKILL);
+    close(p.request);
+    close(p.reply);
+    int status = 0;
+    while (waitpid(p.pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    string message = timedOut ? "timed out after " + to_string(timeout.count()) + " s"
+                   : WIFSIGNALED(status) ? string("worker process crashed: ") + strsignal(WTERMSIG(status))
+                   : "worker process exited with status " + to_string(WEXITSTATUS(status));
+    ++done_;
+    Metrics &metrics = Metrics::global();
+    --metrics.tasksRunning;
+    ++metrics.filesFailed;
+    writer.error(file.name, message);
+
+    p = Process();
+    start(p);
+    ++restarts_;
+}
+
+int workerProcess(const Options &options)
+{
+    // members of an archive come by index into its member list, read here once
+    unique_ptr<Archive> archive;
+    if (Archive::isArchive(options.inputPath)) {
+        archive = make_unique<Archive>(options.inputPath);
+    }
+    vector<string> request;
+    while (readMessage(requestFd, request) && request.size() == 2) {
+        vector<string> reply;
+        try {
+            auto input = archive ? archive->open(stoul(request[0]), !options.decode.probeOnly)
+                                 : loadFile(request[0], options.mmap, !options.decode.probeOnly);
+            bool cacheable;
+            AnalysisResult r = analyzeFile(*input, request[1], options.decode, nullptr, nullptr, cacheable);
+            reply = {"ok", to_string(r.duration), to_string(r.frequency), cacheable ? "1" : "0"};
+            reply.insert(reply.end(), r.values.begin(), r.values.end());
+        } catch (exception &e) {
+            reply = {"error", e.what()};
+        }
+        if (!writeMessage(replyFd, reply)) {
+            return 1;
+        }
+    }
+    return 0;
+}
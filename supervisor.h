@@ -0,0 +1,81 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+#include "analysisCache.h"
+#include "options.h"
+#include "resultWriter.h"
+
+/**
+  Multi-process mode (--processes N): files are analyzed by N worker
+  processes, so a file that crashes or hangs FFmpeg, KeyFinder or aubio
+  costs only its own worker. Each worker is this program started again
+  with --worker-process; it gets one file at a time over a pipe and sends
+  the result back. A worker that dies or runs longer than the timeout on
+  one file is killed, the file goes to the error file and a fresh worker
+  takes over.
+  All methods are called from one thread; results go to the ResultWriter.
+ *
+ */
+class Supervisor
+{
+    struct File {
+        std::string path, name;
+        CacheKey key;
+        uint64_t size;
+    };
+    struct Process {
+        pid_t pid{-1};
+        int request{-1};    // to the worker
+        int reply{-1};      // from the worker
+        bool busy{false};
+        File file;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    std::vector<std::string> args;
+    std::chrono::seconds timeout;
+    ResultWriter &writer;
+    std::vector<Process> processes;
+    std::deque<File> pending;
+    size_t restarts_{0};
+    size_t done_{0};
+public:
+    // argv of this run, passed on to the workers; timeout 0 = none
+    Supervisor(int argc, char **argv, size_t processCount, std::chrono::seconds timeout, ResultWriter &writer);
+    Supervisor(const Supervisor &) = delete;
+    Supervisor & operator=(const Supervisor &) = delete;
+    // stops the workers
+    ~Supervisor();
+
+    // hand the file to a free worker; serves the busy ones until one is free
+    void submit(std::string path, std::string name, CacheKey key, uint64_t size);
+    // wait until every submitted file has a result
+    void finish();
+
+    size_t capacity() const { return processes.size(); }
+    // files with a result or an error
+    size_t done() const { return done_; }
+    // workers started again after a crash or timeout
+    size_t restarts() const { return restarts_; }
+private:
+    void start(Process &p);
+    void stop(Process &p);
+    void send(Process &p, File file);
+    // wait up to the next deadline for results; false if no worker is busy
+    bool serve();
+    void receive(Process &p);
+    // worker died or hung (timedOut) with a file: report it and start a new one
+    void fail(Process &p, bool timedOut);
+};
+
+/**
+  Body of a worker process: analyze the files the supervisor sends
+  on fd 3 and reply on fd 4 until the supervisor closes the pipe.
+  Returns the process exit code
+ *
+ */
+int workerProcess(const Options &options);
@@ -0,0 +1,191 @@
+#include "watcher.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+DirectoryWatcher::DirectoryWatcher(const string &folder, bool recursive, chrono::milliseconds settle)
+    : root(folder), recursive(recursive), settle(settle)
+{
+    while (root.size() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    clock_gettime(CLOCK_REALTIME, &started);
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        throw runtime_error(string("can't start inotify: ") + strerror(errno));
+    }
+    try {
+        // the files there now are the scan's
+        watch("", false);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    close(fd);
+}
+
+void DirectoryWatcher::watch(const string &rel, bool reportFiles, bool changedOnly)
+{
+    string path = rel.empty() ? root : root + "/" + rel;
+    int wd = inotify_add_watch(fd, path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+    if (wd < 0) {
+        if (rel.empty()) {
+            throw runtime_error("can't watch " + path + ": " + strerror(errno));
+        }
+        // removed again already is fine, running out of watches (max_user_watches) is not
+        if (errno != ENOENT && errno != ENOTDIR) {
+            cout << "can't watch " << path << ": " << strerror(errno) << endl;
+        }
+        return;
+    }
+    // a folder moved within the tree keeps its descriptor, and so do its
+    // sub folders: their paths get the new prefix too
+    auto known = dirs.find(wd);
+    if (known != dirs.end() && known->second != rel && !known->second.empty()) {
+        string old = known->second + "/";
+        for (auto &d : dirs) {
+            if (d.second.compare(0, old.size(), old) == 0) {
+                d.second = (rel.empty() ? "" : rel + "/") + d.second.substr(old.size());
+            }
+        }
+    }
+    dirs[wd] = rel;
+    DIR *d = opendir(path.c_str());
+    if (!d) {
+        return;
+    }
+    auto now = Clock::now();
+    vector<string> subdirs;
+    while (dirent *e = readdir(d)) {
+        string name(e->d_name);
+        if (name == "." || name == "..") {
+            continue;
+        }
+        string relPath = rel.empty() ? name : rel + "/" + name;
+        unsigned char type = e->d_type;
+        struct stat st;
+        bool statted = false;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (fstatat(dirfd(d), name.c_str(), &st, 0) != 0) {
+                continue;
+            }
+            statted = true;
+            // symlinked folders are not followed, as in the scan
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && type == DT_UNKNOWN ? DT_DIR : DT_UNKNOWN;
+        }
+        if (type == DT_DIR && recursive) {
+            subdirs.push_back(relPath);
+        } else if (type == DT_REG && reportFiles) {
+            if (changedOnly) {
+                if (!statted && fstatat(dirfd(d), name.c_str(), &st, 0) != 0) {
+                    continue;
+                }
+                if (st.st_mtim.tv_sec < started.tv_sec ||
+                    (st.st_mtim.tv_sec == started.tv_sec && st.st_mtim.tv_nsec < started.tv_nsec)) {
+                    continue;
+                }
+            }
+            pending[relPath] = now;
+        }
+    }
+    closedir(d);
+    for (auto &s : subdirs) {
+        watch(s, reportFiles, changedOnly);
+    }
+}
+
+void DirectoryWatcher::readEvents()
+{
+    alignas(inotify_event) char buf[64 * 1024];
+    bool overflow = false;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        auto now = Clock::now();
+        for (char *p = buf; p < buf + n;) {
+            auto *e = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(inotify_event) + e->len;
+            if (e->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            if (e->mask & IN_IGNORED) {
+                dirs.erase(e->wd);
+                continue;
+            }
+            auto dir = dirs.find(e->wd);
+            if (dir == dirs.end() || e->len == 0) {
+                continue;
+            }
+            string rel = dir->second.empty() ? string(e->name) : dir->second + "/" + e->name;
+            if (e->mask & IN_ISDIR) {
+                if (recursive && (e->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    watch(rel, true);
+                }
+            } else if (e->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                // a new event starts the settle time over
+                pending[rel] = now;
+            }
+        }
+    }
+    if (overflow) {
+        // events were lost: every file written since watching started, the
+        // caller skips those it already has with the same size and time
+        watch("", true, true);
+    }
+}
+
+void DirectoryWatcher::drain()
+{
+    readEvents();
+}
+
+vector<string> DirectoryWatcher::next(chrono::milliseconds timeout)
+{
+    auto deadline = Clock::now() + timeout;
+    for (;;) {
+        auto now = Clock::now();
+        vector<string> ready;
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (now - it->second >= settle) {
+                ready.push_back(it->first);
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (!ready.empty() || now >= deadline) {
+            return ready;
+        }
+        // until the next file settles or the deadline
+        auto wake = deadline;
+        for (auto &p : pending) {
+            wake = min(wake, p.second + settle);
+        }
+        pollfd p{fd, POLLIN, 0};
+        int ms = int(chrono::duration_cast<chrono::milliseconds>(wake - now).count()) + 1;
+        int r = poll(&p, 1, ms);
+        if (r < 0) {
+            if (errno == EINTR) {
+                return {};
+            }
+            throw runtime_error(string("poll failed: ") + strerror(errno));
+        }
+        if (r > 0) {
+            readEvents();
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+  Files written to a folder, from inotify: a file is reported once it was
+  closed after writing or moved in and then left alone for the settle
+  time, so a copy in progress or a tagger writing twice is reported once.
+  Sub folders created or moved in later are watched too, and the files
+  they brought along reported. If the kernel's event queue overflowed,
+  every file of the watched folders changed since the watcher started is
+  reported again
+ *
+ */
+class DirectoryWatcher
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // throws std::runtime_error if inotify is not available or folder can't be watched
+    DirectoryWatcher(const std::string &folder, bool recursive, std::chrono::milliseconds settle);
+    DirectoryWatcher(const DirectoryWatcher &) = delete;
+    DirectoryWatcher & operator=(const DirectoryWatcher &) = delete;
+    ~DirectoryWatcher();
+
+    /**
+      Files that settled, relative to the folder; waits up to timeout for
+      one, returns early (maybe empty) if a signal interrupts the wait
+     *
+     */
+    std::vector<std::string> next(std::chrono::milliseconds timeout);
+    // take the events queued so far without waiting: call it while busy
+    // with other work, so the kernel's event queue doesn't overflow
+    void drain();
+private:
+    std::string root;
+    bool recursive;
+    std::chrono::milliseconds settle;
+    int fd{-1};
+    // watch descriptor -> folder relative to root
+    std::unordered_map<int, std::string> dirs;
+    // file -> time of its last event
+    std::map<std::string, Clock::time_point> pending;
+    // when watching started, seconds and nanoseconds since epoch
+    struct timespec started;
+
+    // and its sub folders; reportFiles - the files in them count as new,
+    // changedOnly - only those modified since watching started
+    void watch(const std::string &rel, bool reportFiles, bool changedOnly = false);
+    void readEvents();
+};
@@ -1,180 +1,306 @@
 #include "worker.h"
-#include <list>
-#include <numeric>
-#include <cstring>
-#include "keyfinder/keyfinder.h"
-#include "aubio/aubio.h"
-#include "aubio/tempo/beattracking.h"
+#include "decodeAudio.h"
+#include "analysis.h"
+#include "metrics.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <vector>
 
 
 using namespace std;
-extern tuple<vector<float>, int64_t, unsigned>  decodeAudio(vector<char> &compressedBuf);
 
-void Worker::operator()()
+// the stage an analyzer's time is counted in
+static Stage stageOf(const string &analyzer)
 {
-    static mutex m;
-    try{
-        auto [waveData, dur, freq]  = decodeAudio(compressedAudio);
-        duration = dur / 1000000;
-        frequency = freq;
-        string key = detectKey(waveData);
-        string tempo=detectTempo(waveData);
+    return analyzer == "key" ? Stage::Key : analyzer == "tempo" ? Stage::Tempo : Stage::Features;
+}
 
-        unique_lock<mutex> lock(m);
-        writeToCSV(key, tempo);
-    }
-    catch(exception &e) {
-        unique_lock<mutex> lock(m);
-        ofstream f("bad.txt", ios::app);
-        f << songName << ": " << e.what() << "\n";
+static vector<unique_ptr<Analyzer>> makeAnalyzers(const DecodeOptions &options)
+{
+    vector<unique_ptr<Analyzer>> analyzers;
+    for (auto &name : options.analyzers) {
+        analyzers.push_back(makeAnalyzer(name));
     }
+    return analyzers;
 }
 
-string Worker::detectTempo(std::vector<float> &wav)
+static AnalysisResult resultOf(const string &name, const AudioInfo &info,
+                               const vector<unique_ptr<Analyzer>> &analyzers)
 {
-    uint_t win_s = 1024; // window size
-    std::shared_ptr<fvec_t> in(new_fvec (win_s), &del_fvec); // input buffer
-    std::shared_ptr<fvec_t> out(new_fvec (win_s / 4), &del_fvec); // output beat position
-
-    // create beattracking object
-    //aubio_beattracking_t * tempo  = new_aubio_beattracking(win_s, 256, 44100);
-    std::shared_ptr<aubio_tempo_t> o(new_aubio_tempo("specdiff", win_s, 512, 44100), &del_aubio_tempo);
-
-    smpl_t bpm, confidence;
-    list<smpl_t> beats;
-    list<smpl_t> bpms_;
-    list<smpl_t> conf;
-    for (int i=0; i < (wav.size())/win_s; ++i) {
-      memcpy(in->data, wav.data()+i*win_s, win_s*4);
-
-      // execute tempo
-      aubio_tempo_do(o.get(), in.get(), out.get());
-      // do something with the beats
-      if (out->data[0] != 0.0 /*&&  aubio_tempo_get_confidence(o)>0.4*/) {
-          beats.push_back(aubio_tempo_get_last_s(o.get()));
-          conf.push_back(aubio_tempo_get_confidence(o.get()));
-          bpms_.push_back(aubio_tempo_get_bpm(o.get()));
-        //printf("beat at %.3fms, %.3fs, frame %d, %.2fbpm with confidence %.2f\n",
-            //aubio_tempo_get_last_ms(o), aubio_tempo_get_last_s(o),
-            //aubio_tempo_get_last(o), aubio_tempo_get_bpm(o), aubio_tempo_get_confidence(o));
-      }
+    AnalysisResult result{name, info.duration / 1000000, info.sampleRate, {}};
+    for (auto &a : analyzers) {
+        a->values(result.values);
+    }
+    return result;
+}
 
+// record - add stage times to the run's metrics, also if the analysis fails
+static AnalysisResult analyze(const InputBuffer &input, const string &name, DecodeOptions options, bool record)
+{
+    DecodeStats stats;
+    array<chrono::nanoseconds, size_t(Stage::Count)> times{};
+    if (record) {
+        options.stats = &stats;
     }
-    smpl_t avgConf=0;
-    smpl_t bestConf=0;
-    smpl_t bestBPM=0;
-    for (auto it1=conf.begin(), it2=bpms_.begin(); it1!=conf.end(); ++it1, ++it2) {
-        avgConf+= *it1;
-        if (bestConf  < *it1)
-        {
-            bestConf = *it1;
-            bestBPM = *it2;
+    auto recordStages = [&] {
+        if (record) {
+            Metrics &m = Metrics::global();
+            m.observe(Stage::Decode, stats.demux + stats.decode + stats.convert);
+            for (Stage s : {Stage::Key, Stage::Tempo, Stage::Features}) {
+                if (times[size_t(s)].count() > 0) {
+                    m.observe(s, times[size_t(s)]);
+                }
+            }
         }
+    };
+    // every analyzer works on the same decode, chunk by chunk
+    auto analyzers = makeAnalyzers(options);
+    vector<TimedSink> timed;
+    timed.reserve(analyzers.size());
+    vector<AudioSink *> sinks;
+    for (size_t i = 0; i < analyzers.size(); ++i) {
+        timed.emplace_back(*analyzers[i], times[size_t(stageOf(options.analyzers[i]))]);
+        sinks.push_back(&timed.back());
     }
-    if (conf.size()>0) avgConf /= conf.size();
-
-    // filter best 50%:
-    smpl_t filterLevel = avgConf;
-    for (auto it=conf.begin(), itBeats=beats.begin(); it!=conf.end(); ++it, ++itBeats) {
-        if (*it < filterLevel) {
-            // delete it
-            it = conf.erase(it);
-            itBeats = beats.erase(itBeats);
-        }
+    SinkFanout sink(move(sinks));
+    AudioInfo info;
+    try {
+        info = decodeAudio(input, sink, options);
+    } catch (...) {
+        recordStages();
+        throw;
     }
+    recordStages();
+    if (record && info.duration > 0) {
+        Metrics::global().audioMicroseconds += uint64_t(info.duration);
+    }
+    return resultOf(name, info, analyzers);
+}
 
-    string strResult;
-    //def beats_to_bpm(beats, path):
-    adjacent_difference(beats.begin(), beats.end(), beats.begin());
-    beats.pop_front();  // first element produced by adjacent_difference is not difference
-           // if enough beats are found, convert to periods then to bpm
-           if (beats.size() > 1) {
-               list<smpl_t> bpms;
-               for (auto it=beats.begin(); it!=beats.end(); ++it) {
-                   if (*it > 0)
-                      bpms.push_back(60.0 / *it);
-               }
-
-               strResult =  to_string(bestBPM);
-           }else{
-               throw std::runtime_error("not enough beats found");
-               }
-
-    // called from shared_ptr:
-    // del_aubio_tempo(o);
-    // del_fvec(in);
-    // del_fvec(out);
-    // aubio_cleanup();  <-- called when all files are done
-    return strResult;
+// pieces of a split file are at least this long
+static const int64_t minPieceMicroseconds = int64_t(5) * 60 * 1000000;
+// smaller files are never long enough to be split: not worth probing
+static const size_t minSplitBytes = size_t(8) << 20;
 
-}
-string Worker::detectKey(std::vector<float> &wavData)
+/**
+  Analyze a long file in pieces: each piece seeks to its time range and is
+  decoded by whichever pool thread claims it; what the pieces' analyzers
+  collected (chromagrams, tempo votes, loudness blocks...) is merged into one result. This thread claims pieces too and only
+  waits for pieces other threads are still working on, so it never waits
+  for a task that is stuck in a queue.
+  Returns false if a piece failed (e.g. the format can't seek)
+ *
+ */
+static bool analyzeSplit(const InputBuffer &input, const DecodeOptions &options, ThreadPool &pool,
+                         int64_t duration, unsigned count, vector<unique_ptr<Analyzer>> &analyzers)
 {
-    const size_t sampleSize{2}; // only 16 bit supported
-    const size_t sampleCount = wavData.size() / sampleSize;
-
-    // Build an empty audio object
-    KeyFinder::AudioData a;
-    // Prepare the object for audio stream
-    a.setFrameRate(frequency);
-    a.setChannels(1);
-    a.addToSampleCount(sampleCount);
-    if (sampleCount <= 0) {
-        throw std::runtime_error("no samples found!");
+    struct Piece {
+        vector<unique_ptr<Analyzer>> analyzers;
+        bool failed{false};
+    };
+    struct Job {
+        vector<unique_ptr<Piece>> pieces;
+        atomic<unsigned> next{0};
+        mutex m;
+        condition_variable cv;
+        unsigned finished{0};
+    };
+    auto job = make_shared<Job>();
+    job->pieces.resize(count);
+    // every piece is analyzed on the thread that claims it, with that thread's context
+    auto work = [job, &input, options, duration, count]() {
+        for (unsigned i; (i = job->next++) < count;) {
+            auto piece = make_unique<Piece>();
+            DecodeOptions range = options;
+            range.rangeBegin = duration / count * i;
+            // duration is the probe's estimate: the last piece goes on to the end of the stream
+            range.rangeEnd = i + 1 < count ? duration / count * (i + 1) : DecodeOptions::toEnd;
+            DecodeStats stats;
+            range.stats = &stats;
+            try {
+                vector<AudioSink *> sinks;
+                piece->analyzers = makeAnalyzers(options);
+                for (auto &a : piece->analyzers) {
+                    a->setPiece();
+                    sinks.push_back(a.get());
+                }
+                SinkFanout sink(move(sinks));
+                decodeAudio(input, sink, range);
+            } catch (...) {
+                piece->failed = true;
+            }
+            Metrics::global().observe(Stage::Decode, stats.demux + stats.decode + stats.convert);
+            {
+                lock_guard<mutex> l{job->m};
+                job->pieces[i] = move(piece);
+                ++job->finished;
+            }
+            job->cv.notify_all();
+        }
+    };
+    for (unsigned i = 1; i < count; ++i) {
+        pool.post(work);
     }
+    work();
+    unique_lock<mutex> l{job->m};
+    job->cv.wait(l, [&] { return job->finished == count; });
 
-    // Populate the KeyFinder::AudioData object with the samples
-    a.resetIterators();
-    for (unsigned int i = 0; i < sampleCount; ++i) {
-        a.setSampleAtWriteIterator(*(wavData.data() + i));
-        //a.setSampleAtWriteIterator(float(*(reinterpret_cast<float*>(wavData.data()) + i)));
-        a.advanceWriteIterator();
+    for (unsigned i = 0; i < count; ++i) {
+        Piece &p = *job->pieces[i];
+        if (p.failed) {
+            return false;
+        }
+        for (size_t k = 0; k < analyzers.size(); ++k) {
+            analyzers[k]->merge(*p.analyzers[k]);
+        }
     }
+    for (auto &a : analyzers) {
+        a->finish();
+    }
+    return true;
+}
 
+// probe mode, or --use-tags and the tags of the enabled key and tempo analyzers present
+// (and no other analyzer): result without decoding
+static bool fromHeaders(const InputBuffer &input, const string &name, const DecodeOptions &options,
+                        AnalysisResult &result)
+{
+    auto &names = options.analyzers;
+    bool wantKey = find(names.begin(), names.end(), "key") != names.end();
+    bool wantTempo = find(names.begin(), names.end(), "tempo") != names.end();
+    if (!options.probeOnly && size_t(wantKey + wantTempo) < names.size()) {
+        return false;
+    }
+    AudioTags tags;
+    AudioInfo info;
+    {
+        StageTimer timer(Stage::Decode);
+        info = probeAudio(input, tags);
+    }
+    string key = keyFromTag(tags.key), tempo = tempoFromTag(tags.tempo);
+    if (!options.probeOnly && ((wantKey && key.empty()) || (wantTempo && tempo.empty()))) {
+        return false;
+    }
+    if (info.duration > 0) {
+        Metrics::global().audioMicroseconds += uint64_t(info.duration);
+    }
+    result = AnalysisResult{name, info.duration / 1000000, info.sampleRate, {}};
+    for (auto &column : analyzerColumns(names)) {
+        result.values.push_back(column == "Key" ? key : column == "Tempo" ? tempo : "");
+    }
+    return true;
+}
 
-    // Static because it retains useful resources for repeat use
-     KeyFinder::KeyFinder k;
-
-
-     // Run the analysis
-     KeyFinder::key_t key = k.keyOfAudio(a);
-
-     switch (key)
-     {
-     case KeyFinder::A_MAJOR:       return "A";
-     case KeyFinder::A_MINOR:       return "Am";
-     case KeyFinder::B_FLAT_MAJOR:  return "Bb";
-     case KeyFinder::B_FLAT_MINOR:  return "Bbm";
-     case KeyFinder::B_MAJOR:       return "B";
-     case KeyFinder::B_MINOR:       return "Bm";
-     case KeyFinder::C_MAJOR:       return "C";
-     case KeyFinder::C_MINOR:       return "Cm";
-     case KeyFinder::D_FLAT_MAJOR:  return "Db";
-     case KeyFinder::D_FLAT_MINOR:  return "C#m";
-     case KeyFinder::D_MAJOR:       return "D";
-     case KeyFinder::D_MINOR:       return "Dm";
-     case KeyFinder::E_FLAT_MAJOR:  return "Eb";
-     case KeyFinder::E_FLAT_MINOR:  return "Ebm";
-     case KeyFinder::E_MAJOR:       return "E";
-     case KeyFinder::E_MINOR:       return "Em";
-     case KeyFinder::F_MAJOR:       return "F";
-     case KeyFinder::F_MINOR:       return "Fm";
-     case KeyFinder::G_FLAT_MAJOR:  return "Gb";
-     case KeyFinder::G_FLAT_MINOR:  return "F#m";
-     case KeyFinder::G_MAJOR:       return "G";
-     case KeyFinder::G_MINOR:       return "Gm";
-     case KeyFinder::A_FLAT_MAJOR:  return "Ab";
-     case KeyFinder::A_FLAT_MINOR:  return "G#m";
-     default: return "";
-     }
-
+AnalysisResult analyzeFile(const InputBuffer &input, const string &name, const DecodeOptions &options,
+                           ThreadPool *pool, SegmentAgreement *agreement, bool &cacheable)
+{
+    cacheable = true;
+    // before FFmpeg's read callbacks: a member of an archive is inflated on first
+    // access, and an error then must not be thrown through FFmpeg
+    input.data();
+    if (options.probeOnly || options.useTags) {
+        AnalysisResult result;
+        if (fromHeaders(input, name, options, result)) {
+            // not cached: a later full analysis must not find these
+            cacheable = false;
+            return result;
+        }
+    }
+    if (pool && options.splitMinutes > 0 && options.segments == 0 && input.size() >= minSplitBytes) {
+        AudioTags tags;
+        AudioInfo info = probeAudio(input, tags);
+        int64_t splitAt = int64_t(options.splitMinutes) * 60 * 1000000;
+        unsigned count = unsigned(min<int64_t>(int64_t(pool->capacity()), info.duration / minPieceMicroseconds));
+        if (info.duration >= splitAt && count > 1) {
+            auto analyzers = makeAnalyzers(options);
+            if (analyzeSplit(input, options, *pool, info.duration, count, analyzers)) {
+                Metrics::global().audioMicroseconds += uint64_t(info.duration);
+                return resultOf(name, info, analyzers);
+            }
+            // pieces failed: analyze the file in one go below
+        }
+    }
+    auto start = chrono::steady_clock::now();
+    AnalysisResult result = analyze(input, name, options, true);
+    // shorter tracks are decoded whole in segment mode too: nothing to compare
+    if (agreement && options.segments > 0 && result.duration >= 2 * options.segmentSeconds * options.segments) {
+        auto middle = chrono::steady_clock::now();
+        DecodeOptions full = options;
+        full.segments = 0;
+        try {
+            AnalysisResult reference = analyze(input, name, full, false);
+            agreement->add(result, reference, middle - start, chrono::steady_clock::now() - middle);
+        } catch (exception &) {
+            // the segment result stands, the file just doesn't count in the comparison
+        }
+    }
+    return result;
+}
 
+void Worker::operator()()
+{
+    try{
+        bool cacheable;
+        AnalysisResult result = analyzeFile(*compressedAudio, songName, decodeOptions, pool, agreement, cacheable);
+        ++Metrics::global().filesAnalyzed;
+        writer.write(move(result), cacheable ? move(cacheKey) : CacheKey{});
+    }
+    catch(exception &e) {
+        ++Metrics::global().filesFailed;
+        writer.error(songName, e.what());
+    }
+    catch(...) {
+        ++Metrics::global().filesFailed;
+        writer.error(songName, "unknown error");
+    }
+}
 
-     return "";
+SegmentAgreement::SegmentAgreement(const vector<string> &columns)
+{
+    auto index = [&](const char *name) {
+        auto it = find(columns.begin(), columns.end(), name);
+        return it == columns.end() ? -1 : int(it - columns.begin());
+    };
+    keyColumn = index("Key");
+    tempoColumn = index("Tempo");
 }
 
+void SegmentAgreement::add(const AnalysisResult &segment, const AnalysisResult &full,
+                           chrono::nanoseconds segmentTime, chrono::nanoseconds fullTime)
+{
+    ++files;
+    if (keyColumn >= 0) {
+        sameKey += segment.values[keyColumn] == full.values[keyColumn];
+    }
+    if (tempoColumn >= 0) {
+        double a = atof(segment.values[tempoColumn].c_str()), b = atof(full.values[tempoColumn].c_str());
+        auto close = [](double x, double y) { return y > 0 && fabs(x - y) <= 0.04 * y; };
+        sameTempo += close(a, b);
+        relatedTempo += close(a, b) || close(a, 2 * b) || close(a, b / 2);
+    }
+    segmentNs += segmentTime.count();
+    fullNs += fullTime.count();
+}
 
-void Worker::writeToCSV(string &key, string &tempo)
+void SegmentAgreement::print(ostream &os) const
 {
-    ofStream << songName << "," << duration << "," << frequency << "," << key << "," << tempo << "\n";
+    size_t n = files;
+    if (n == 0) {
+        os << "segment mode: no file long enough to compare with full-track analysis\n";
+        return;
+    }
+    auto percent = [n](size_t k) { return int(100.0 * k / n + 0.5); };
+    os << "segment mode vs full track, " << n << " file(s): ";
+    if (keyColumn >= 0) {
+        os << "key " << percent(sameKey) << "% same, ";
+    }
+    if (tempoColumn >= 0) {
+        os << "tempo " << percent(sameTempo) << "% within 4% (" << percent(relatedTempo)
+           << "% counting half/double tempo), ";
+    }
+    os << fixed << setprecision(1) << (segmentNs ? double(fullNs) / segmentNs : 0.0) << "x faster\n";
 }
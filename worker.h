@@ -1,30 +1,84 @@
-#include <queue>
+#pragma once
+#include <deque>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <future>
 #include <condition_variable>
 #include <fstream>
+#include <atomic>
+#include <cstdint>
+#include "inputBuffer.h"
+#include "decodeAudio.h"
+#include "analysisCache.h"
+#include "resultWriter.h"
+#include "metrics.h"
+
+/**
+  How segment mode results compare to full-track analysis of the same files
+  (--compare-full), updated by the workers
+ *
+ */
+struct SegmentAgreement
+{
+    // of the Key and Tempo columns in the results, -1 if not enabled
+    int keyColumn{-1};
+    int tempoColumn{-1};
+    std::atomic<size_t> files{0};
+    std::atomic<size_t> sameKey{0};
+    std::atomic<size_t> sameTempo{0};       // within 4%
+    std::atomic<size_t> relatedTempo{0};    // within 4% of half, same or double tempo
+    std::atomic<int64_t> segmentNs{0};
+    std::atomic<int64_t> fullNs{0};
+
+    // columns - of the enabled analyzers
+    explicit SegmentAgreement(const std::vector<std::string> &columns);
+    void add(const AnalysisResult &segment, const AnalysisResult &full,
+             std::chrono::nanoseconds segmentTime, std::chrono::nanoseconds fullTime);
+    void print(std::ostream &os) const;
+};
+
+class ThreadPool;
+
+/**
+  Analysis of one loaded file by the analyzers options enables:
+  key and tempo from the tags, in pieces on the pool's threads (pool set)
+  or decoded on the calling thread. agreement set: segment mode files are
+  analyzed a second time in full for the comparison.
+  cacheable is false for results taken from headers and tags.
+  throws std::exception if the file can't be analyzed
+ *
+ */
+AnalysisResult analyzeFile(const InputBuffer &input, const std::string &name, const DecodeOptions &options,
+                           ThreadPool *pool, SegmentAgreement *agreement, bool &cacheable);
 
 class Worker
 {
-    std::vector<char> compressedAudio;
+    std::unique_ptr<InputBuffer> compressedAudio;
     std::string songName;
-    std::ofstream &ofStream;
-    int64_t duration;
-    unsigned frequency;
+    ResultWriter &writer;
+    const DecodeOptions &decodeOptions;
+    CacheKey cacheKey;
+    SegmentAgreement *agreement;
+    ThreadPool *pool;
 public:
-    Worker(std::vector<char> &&v, std::ofstream &ofStream, std::string name) :
-         compressedAudio(v), ofStream(ofStream), songName(name) {}
+    // a cacheKey with an empty path keeps the result out of the cache,
+    // with agreement set a segment mode file is analyzed a second time in full,
+    // with pool set a long file is split into pieces analyzed by the pool's threads
+    Worker(std::unique_ptr<InputBuffer> input, ResultWriter &writer, const DecodeOptions &decodeOptions,
+           std::string name, CacheKey cacheKey = {}, SegmentAgreement *agreement = nullptr,
+           ThreadPool *pool = nullptr) :
+         compressedAudio(std::move(input)), songName(std::move(name)), writer(writer), decodeOptions(decodeOptions),
+         cacheKey(std::move(cacheKey)), agreement(agreement), pool(pool) {}
     Worker() = delete;
     Worker(const Worker &) = delete;
-    Worker(const Worker && w) : compressedAudio(std::move(w.compressedAudio)), ofStream(w.ofStream), songName(w.songName){}
+    Worker(Worker && w) : compressedAudio(std::move(w.compressedAudio)), songName(std::move(w.songName)), writer(w.writer),
+                          decodeOptions(w.decodeOptions), cacheKey(std::move(w.cacheKey)), agreement(w.agreement), pool(w.pool) {}
     Worker & operator=(const Worker &) = delete;
     ~Worker() = default;
     void operator()();
-private:
-    void writeToCSV(std::string &key, std::string &tempo);
-    std::string detectTempo(std::vector<float> &wav);
-    std::string detectKey(std::vector<float> &wav);
+    // bytes of input held by this task (counted against the pool's byte budget)
+    size_t inputSize() const { return compressedAudio->size(); }
 };
 
 
@@ -33,6 +87,14 @@ private:
 #define THREAD_POOL_NAMESPACE_NAME thread_pool
 #endif
 
+/**
+  Work-stealing thread pool: every thread owns a deque of tasks,
+  submit() deals tasks out round robin and an idle thread takes work
+  from the other threads' deques before going to sleep.
+  Tasks run in submission order, so submitting large files first keeps
+  one late long file from becoming the tail of the whole run.
+ *
+ */
 class ThreadPool {
 private:
     class TaskWrapper {
@@ -51,9 +113,14 @@ private:
 
     public:
         template <typename F>
-        TaskWrapper(F f) : impl{std::make_unique<ImplType<F>>(std::move(f))} {}
+        TaskWrapper(F f, size_t bytes = 0) : impl{std::make_unique<ImplType<F>>(std::move(f))}, bytes(bytes) {}
 
         auto operator()() { impl->call(); }
+
+        size_t bytes;
+        // runs part of another task (post()): not counted as a file
+        bool helper{false};
+        std::chrono::steady_clock::time_point submitted{std::chrono::steady_clock::now()};
     };
 
     class JoinThreads {
@@ -72,48 +139,100 @@ private:
     };
 
 public:
+    /**
+      maxQueued - max number of tasks waiting for a free thread
+      maxQueuedBytes - max input bytes held by waiting and running tasks together;
+      submit() blocks while either limit is reached, so memory use is bounded by
+      the budget rather than by the number of submitted files.
+      A single task bigger than the byte budget is still admitted when the pool is empty.
+     *
+     */
     explicit ThreadPool(
-        size_t threadCount = std::thread::hardware_concurrency())
-        : _done{false}, _joiner{_threads} {
+        size_t threadCount = std::thread::hardware_concurrency(),
+        size_t maxQueued = SIZE_MAX, size_t maxQueuedBytes = SIZE_MAX)
+        : _done{false}, _maxQueued{maxQueued ? maxQueued : 1}, _maxQueuedBytes{maxQueuedBytes},
+          _queues(threadCount ? threadCount : 1), _joiner{_threads} {
         if (0u == threadCount) {
             threadCount = 1u;
         }
+        _started = std::chrono::steady_clock::now();
         _threads.reserve(threadCount);
         try {
             for (size_t i = 0; i < threadCount; ++i) {
-                _threads.emplace_back(&ThreadPool::workerThread, this);
+                _threads.emplace_back(&ThreadPool::workerThread, this, i);
             }
         } catch (...) {
-            _done = true;
-            _queue.cv.notify_all();
+            stop();
             exception = std::current_exception();
             throw;
         }
     }
 
     ~ThreadPool() {
-        _done = true;
-        _queue.cv.notify_all();
+        stop();
     }
 
     size_t capacity() const { return _threads.size(); }
-    size_t queueSize() const {
-        std::unique_lock<std::mutex> l{_queue.m};
-        return _queue.q.size();
-    }
+    size_t queueSize() const { return _pending; }
 
-    
-    void submit(Worker w) {
+    // blocks while the queue depth or byte budget is exhausted;
+    // a Worker, or any task with operator()() and inputSize()
+    template <typename Task>
+    void submit(Task w) {
+        size_t bytes = w.inputSize();
         {
-            std::lock_guard<std::mutex> l{_queue.m};
-            _queue.q.push(std::move(w));
+            std::unique_lock<std::mutex> l{_budget.m};
+            _budget.space.wait(l, [&] {
+                return _done ||
+                       (_pending < _maxQueued &&
+                        (_budget.bytes == 0 || _budget.bytes + bytes <= _maxQueuedBytes));
+            });
+            if (_done) {
+                return;
+            }
+            _budget.bytes += bytes;
         }
-        _queue.cv.notify_all();
+        {
+            // counted before a thread can take the task: takeTask() decrements it,
+            // taken so a thread can't miss the wake-up between its check and its wait
+            std::lock_guard<std::mutex> l{_idle.m};
+            ++_pending;
+        }
+        ++Metrics::global().tasksQueued;
+        auto &queue = _queues[_nextQueue++ % _queues.size()];
+        {
+            std::lock_guard<std::mutex> l{queue.m};
+            queue.q.emplace_back(std::move(w), bytes);
+        }
+        _idle.cv.notify_one();
         ++totalSubmitted;
     }
 
+    /**
+      Extra task for a running one (pieces of a split file).
+      Never blocks and ignores the budget: the caller holds a thread
+      and must not wait for queue space
+     *
+     */
+    template <typename F>
+    void post(F f) {
+        {
+            // before the task is visible, as in submit()
+            std::lock_guard<std::mutex> l{_idle.m};
+            ++_pending;
+        }
+        ++Metrics::global().tasksQueued;
+        auto &queue = _queues[_nextQueue++ % _queues.size()];
+        {
+            std::lock_guard<std::mutex> l{queue.m};
+            queue.q.emplace_back(std::move(f), 0);
+            queue.q.back().helper = true;
+        }
+        _idle.cv.notify_one();
+    }
+
     int getPercentDone() {
-        if (totalSubmitted == 0) return 0;
+        if (totalSubmitted == 0) return 100;  // nothing to wait for
         return 100 * totalDone / totalSubmitted;
     }
 
@@ -123,6 +242,36 @@ public:
 
     bool done() {return _done;}
 
+    /**
+      Share of the pool's thread time spent running tasks since the pool was created,
+      1.0 means every thread was busy all the time
+     *
+     */
+    double utilization() const {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - _started).count();
+        if (wall <= 0) return 0;
+        double busy = 0;
+        for (auto &q : _queues) {
+            busy += q.busyNs * 1e-9;
+        }
+        return busy / (wall * _queues.size());
+    }
+
+    // per-thread busy time in seconds
+    std::vector<double> busySeconds() const {
+        std::vector<double> v;
+        for (auto &q : _queues) {
+            v.push_back(q.busyNs * 1e-9);
+        }
+        return v;
+    }
+
+    // number of tasks taken from another thread's deque
+    size_t steals() const { return _steals; }
+
+    // tasks that ended with an exception instead of a result
+    size_t failedTasks() const { return _failedTasks; }
+
     ThreadPool(const ThreadPool&) = delete;
     ThreadPool(ThreadPool&) = delete;
     ThreadPool& operator=(const ThreadPool&) = delete;
@@ -130,38 +279,124 @@ public:
     std::exception_ptr exception;
 
 private:
-    void workerThread() {
+    void stop() {
+        {
+            std::lock_guard<std::mutex> l{_idle.m};
+            _done = true;
+        }
+        _idle.cv.notify_all();
+        {
+            std::lock_guard<std::mutex> l{_budget.m};
+        }
+        _budget.space.notify_all();
+    }
+
+    // own deque first, then the others starting with the next thread
+    bool takeTask(size_t self, std::unique_ptr<TaskWrapper> &task) {
+        for (size_t i = 0; i < _queues.size(); ++i) {
+            auto &queue = _queues[(self + i) % _queues.size()];
+            std::lock_guard<std::mutex> l{queue.m};
+            if (queue.q.empty()) {
+                continue;
+            }
+            // thieves also take the oldest task: it is the largest one left there
+            task = std::make_unique<TaskWrapper>(std::move(queue.q.front()));
+            queue.q.pop_front();
+            --_pending;
+            if (i != 0) {
+                ++_steals;
+            }
+            Metrics &metrics = Metrics::global();
+            --metrics.tasksQueued;
+            metrics.observe(Stage::QueueWait, std::chrono::steady_clock::now() - task->submitted);
+            return true;
+        }
+        return false;
+    }
+
+    void workerThread(size_t self) {
         while (!_done) {
-            std::unique_lock<std::mutex> l{_queue.m};
-            _queue.cv.wait(l, [&] { return !_queue.q.empty() || _done; });
-            if (_done) {
-                break;
+            std::unique_ptr<TaskWrapper> task;
+            if (!takeTask(self, task)) {
+                std::unique_lock<std::mutex> l{_idle.m};
+                _idle.cv.wait(l, [&] { return _pending > 0 || _done; });
+                continue;
+            }
+            {
+                // a queue slot is free now
+                std::lock_guard<std::mutex> l{_budget.m};
             }
-            auto task = std::move(_queue.q.front());
-            _queue.q.pop();
-            l.unlock();
+            _budget.space.notify_one();
+            auto start = std::chrono::steady_clock::now();
+            ++Metrics::global().tasksRunning;
             try {
-                task();
+                (*task)();
             } catch (...) {
-            _done = true;
-            _queue.cv.notify_all();
-            exception = std::current_exception();
-            throw;
+                // costs this task, not the run: the first one is kept for the end of the run
+                std::lock_guard<std::mutex> l{_idle.m};
+                if (!exception) {
+                    exception = std::current_exception();
+                }
+                if (!task->helper) {
+                    ++_failedTasks;
+                }
             }
+            --Metrics::global().tasksRunning;
+            _queues[self].busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            size_t bytes = task->bytes;
+            bool helper = task->helper;
+            task.reset();  // frees the input buffer before it leaves the budget
+            release(bytes);
+
+            if (!helper) {
+                ++totalDone;
+            }
+        }
+    }
 
-            ++totalDone;
+    // task finished and dropped its input buffer
+    void release(size_t bytes) {
+        {
+            std::lock_guard<std::mutex> l{_budget.m};
+            _budget.bytes -= bytes;
         }
+        _budget.space.notify_one();
     }
 
-    struct TaskQueue {
-        std::queue<TaskWrapper> q;
+    struct WorkQueue {
+        std::deque<TaskWrapper> q;
+        std::mutex m;
+        // time this queue's thread spent running tasks
+        std::atomic<int64_t> busyNs{0};
+    };
+
+    struct Budget {
+        std::mutex m;
+        // signalled when a slot or budget bytes are released
+        std::condition_variable space;
+        // input bytes of queued and running tasks
+        size_t bytes{0};
+    };
+
+    struct Idle {
         std::mutex m;
         std::condition_variable cv;
     };
 
 private:
     std::atomic_bool _done;
-    mutable TaskQueue _queue;
+    const size_t _maxQueued;
+    const size_t _maxQueuedBytes;
+    std::vector<WorkQueue> _queues;
+    Budget _budget;
+    Idle _idle;
+    // tasks sitting in any deque
+    std::atomic<size_t> _pending{0};
+    std::atomic<size_t> _nextQueue{0};
+    std::atomic<size_t> _steals{0};
+    std::atomic<size_t> _failedTasks{0};
+    std::chrono::steady_clock::time_point _started;
     std::vector<std::thread> _threads;
     JoinThreads _joiner;
     std::atomic_int totalSubmitted{0};